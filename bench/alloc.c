@@ -0,0 +1,426 @@
+// Microbenchmarks for LZArena against the system allocator.
+//
+//     make && ./alloc [case]
+//
+// Link with -ljemalloc or -lmimalloc (make alloc-jemalloc, alloc-mimalloc)
+// to put those allocators in place of malloc. Every case stores and touches
+// what it allocates so neither side can be optimized away.
+
+#include "lzarena.h"
+#include "bench.h"
+#include <pthread.h>
+#include <string.h>
+
+#ifndef MALLOC_NAME
+    #define MALLOC_NAME "malloc"
+#endif
+
+#define SMALL_OPS ((size_t)1 << 20)
+#define REALLOC_ITEMS ((size_t)1 << 16)
+#define REALLOC_ARRAYS 64
+#define FREE_ALL_CYCLES 100000
+#define FREE_ALL_ALLOCS 64
+#define FREE_ALL_SIZE 1000
+#define CHURN_OPS 100000
+#define CHURN_ALLOCS 16
+#define THREADS 4
+
+static void *ptrs[SMALL_OPS];
+
+static double small_lzarena(size_t min, size_t max, LZArena *arena){
+    uint64_t seed = BENCH_SEED;
+    double start = bench_now();
+
+    for(size_t i = 0; i < SMALL_OPS; i++){
+        char *ptr = LZARENA_ALLOC_FAST(bench_size(min, max, &seed), arena);
+
+        if(!ptr){
+            bench_fail("small", "lzarena");
+        }
+
+        ptr[0] = (char)i;
+        ptrs[i] = ptr;
+    }
+
+    lzarena_free_all(arena);
+
+    return bench_now() - start;
+}
+
+static double small_malloc(size_t min, size_t max){
+    uint64_t seed = BENCH_SEED;
+    double start = bench_now();
+
+    for(size_t i = 0; i < SMALL_OPS; i++){
+        char *ptr = malloc(bench_size(min, max, &seed));
+
+        if(!ptr){
+            bench_fail("small", MALLOC_NAME);
+        }
+
+        ptr[0] = (char)i;
+        ptrs[i] = ptr;
+    }
+
+    for(size_t i = 0; i < SMALL_OPS; i++){
+        free(ptrs[i]);
+    }
+
+    return bench_now() - start;
+}
+
+static void run_sizes(const char *name, size_t min, size_t max){
+    LZArena *arena = lzarena_create(NULL);
+    double lz = 1e30;
+    double sys = 1e30;
+
+    if(!arena){
+        bench_fail(name, "lzarena");
+    }
+
+    for(int run = 0; run < BENCH_RUNS; run++){
+        double t = small_lzarena(min, max, arena);
+        lz = t < lz ? t : lz;
+        t = small_malloc(min, max);
+        sys = t < sys ? t : sys;
+    }
+
+    lzarena_destroy(arena);
+    bench_report(name, "lzarena", SMALL_OPS, lz);
+    bench_report(name, MALLOC_NAME, SMALL_OPS, sys);
+}
+
+// Two arrays grown one item at a time with capacity doubling, interleaved
+// so that only one of them can grow in place at any moment.
+static double realloc_lzarena(LZArena *arena){
+    double start = bench_now();
+
+    for(size_t n = 0; n < REALLOC_ARRAYS; n++){
+        int *items[2] = {NULL, NULL};
+        size_t cap = 0;
+
+        for(size_t i = 0; i < REALLOC_ITEMS; i++){
+            if(i == cap){
+                size_t new_cap = cap ? cap * 2 : 8;
+
+                for(int k = 0; k < 2; k++){
+                    items[k] = LZARENA_REALLOC(items[k], cap * sizeof(int), new_cap * sizeof(int), arena);
+
+                    if(!items[k]){
+                        bench_fail("realloc", "lzarena");
+                    }
+                }
+
+                cap = new_cap;
+            }
+
+            items[0][i] = (int)i;
+            items[1][i] = (int)i;
+        }
+
+        lzarena_free_all(arena);
+    }
+
+    return bench_now() - start;
+}
+
+static double realloc_malloc(void){
+    double start = bench_now();
+
+    for(size_t n = 0; n < REALLOC_ARRAYS; n++){
+        int *items[2] = {NULL, NULL};
+        size_t cap = 0;
+
+        for(size_t i = 0; i < REALLOC_ITEMS; i++){
+            if(i == cap){
+                size_t new_cap = cap ? cap * 2 : 8;
+
+                for(int k = 0; k < 2; k++){
+                    items[k] = realloc(items[k], new_cap * sizeof(int));
+
+                    if(!items[k]){
+                        bench_fail("realloc", MALLOC_NAME);
+                    }
+                }
+
+                cap = new_cap;
+            }
+
+            items[0][i] = (int)i;
+            items[1][i] = (int)i;
+        }
+
+        free(items[0]);
+        free(items[1]);
+    }
+
+    return bench_now() - start;
+}
+
+static void run_realloc(void){
+    LZArena *arena = lzarena_create(NULL);
+    double lz = 1e30;
+    double sys = 1e30;
+
+    if(!arena){
+        bench_fail("realloc", "lzarena");
+    }
+
+    for(int run = 0; run < BENCH_RUNS; run++){
+        double t = realloc_lzarena(arena);
+        lz = t < lz ? t : lz;
+        t = realloc_malloc();
+        sys = t < sys ? t : sys;
+    }
+
+    lzarena_destroy(arena);
+    bench_report("realloc", "lzarena", REALLOC_ARRAYS * REALLOC_ITEMS * 2, lz);
+    bench_report("realloc", MALLOC_NAME, REALLOC_ARRAYS * REALLOC_ITEMS * 2, sys);
+}
+
+// One op is a whole cycle: FREE_ALL_ALLOCS blocks spread over several
+// regions, then a reset.
+static void run_free_all(void){
+    LZArena *arena = lzarena_create(NULL);
+    void *blocks[FREE_ALL_ALLOCS];
+    double lz = 1e30;
+    double sys = 1e30;
+
+    if(!arena){
+        bench_fail("free_all", "lzarena");
+    }
+
+    for(int run = 0; run < BENCH_RUNS; run++){
+        double start = bench_now();
+
+        for(size_t cycle = 0; cycle < FREE_ALL_CYCLES; cycle++){
+            for(size_t i = 0; i < FREE_ALL_ALLOCS; i++){
+                char *ptr = LZARENA_ALLOC_FAST(FREE_ALL_SIZE, arena);
+
+                if(!ptr){
+                    bench_fail("free_all", "lzarena");
+                }
+
+                ptr[0] = (char)i;
+            }
+
+            lzarena_free_all(arena);
+        }
+
+        double t = bench_now() - start;
+        lz = t < lz ? t : lz;
+        start = bench_now();
+
+        for(size_t cycle = 0; cycle < FREE_ALL_CYCLES; cycle++){
+            for(size_t i = 0; i < FREE_ALL_ALLOCS; i++){
+                char *ptr = malloc(FREE_ALL_SIZE);
+
+                if(!ptr){
+                    bench_fail("free_all", MALLOC_NAME);
+                }
+
+                ptr[0] = (char)i;
+                blocks[i] = ptr;
+            }
+
+            for(size_t i = 0; i < FREE_ALL_ALLOCS; i++){
+                free(blocks[i]);
+            }
+        }
+
+        t = bench_now() - start;
+        sys = t < sys ? t : sys;
+    }
+
+    lzarena_destroy(arena);
+    bench_report("free_all", "lzarena", FREE_ALL_CYCLES, lz);
+    bench_report("free_all", MALLOC_NAME, FREE_ALL_CYCLES, sys);
+}
+
+static double churn_lzarena(void){
+    double start = bench_now();
+
+    for(size_t n = 0; n < CHURN_OPS; n++){
+        LZArena *arena = lzarena_create(NULL);
+
+        if(!arena){
+            bench_fail("churn", "lzarena");
+        }
+
+        for(size_t i = 0; i < CHURN_ALLOCS; i++){
+            char *ptr = LZARENA_ALLOC_FAST(64, arena);
+
+            if(!ptr){
+                bench_fail("churn", "lzarena");
+            }
+
+            ptr[0] = (char)i;
+        }
+
+        lzarena_destroy(arena);
+    }
+
+    return bench_now() - start;
+}
+
+static double churn_malloc(void){
+    void *blocks[CHURN_ALLOCS];
+    double start = bench_now();
+
+    for(size_t n = 0; n < CHURN_OPS; n++){
+        for(size_t i = 0; i < CHURN_ALLOCS; i++){
+            char *ptr = malloc(64);
+
+            if(!ptr){
+                bench_fail("churn", MALLOC_NAME);
+            }
+
+            ptr[0] = (char)i;
+            blocks[i] = ptr;
+        }
+
+        for(size_t i = 0; i < CHURN_ALLOCS; i++){
+            free(blocks[i]);
+        }
+    }
+
+    return bench_now() - start;
+}
+
+static void run_churn(void){
+    double lz = 1e30;
+    double sys = 1e30;
+
+    for(int run = 0; run < BENCH_RUNS; run++){
+        double t = churn_lzarena();
+        lz = t < lz ? t : lz;
+        t = churn_malloc();
+        sys = t < sys ? t : sys;
+    }
+
+    lzarena_cache_trim(0);
+    bench_report("churn", "lzarena", CHURN_OPS, lz);
+    bench_report("churn", MALLOC_NAME, CHURN_OPS, sys);
+}
+
+// Each thread runs the small object case on its own arena, or on the
+// shared malloc heap.
+static void *thread_lzarena(void *arg){
+    LZArena *arena = lzarena_create(NULL);
+    uint64_t seed = BENCH_SEED;
+
+    (void)arg;
+
+    if(!arena){
+        bench_fail("threads", "lzarena");
+    }
+
+    for(size_t i = 0; i < SMALL_OPS; i++){
+        char *ptr = LZARENA_ALLOC_FAST(bench_size(16, 64, &seed), arena);
+
+        if(!ptr){
+            bench_fail("threads", "lzarena");
+        }
+
+        ptr[0] = (char)i;
+    }
+
+    lzarena_destroy(arena);
+    lzarena_cache_trim(0);
+
+    return NULL;
+}
+
+static void *thread_malloc(void *arg){
+    void **blocks = malloc(SMALL_OPS * sizeof(void *));
+    uint64_t seed = BENCH_SEED;
+
+    (void)arg;
+
+    if(!blocks){
+        bench_fail("threads", MALLOC_NAME);
+    }
+
+    for(size_t i = 0; i < SMALL_OPS; i++){
+        char *ptr = malloc(bench_size(16, 64, &seed));
+
+        if(!ptr){
+            bench_fail("threads", MALLOC_NAME);
+        }
+
+        ptr[0] = (char)i;
+        blocks[i] = ptr;
+    }
+
+    for(size_t i = 0; i < SMALL_OPS; i++){
+        free(blocks[i]);
+    }
+
+    free(blocks);
+
+    return NULL;
+}
+
+static double run_threads_with(void *(*fn)(void *)){
+    pthread_t threads[THREADS];
+    double start = bench_now();
+
+    for(int i = 0; i < THREADS; i++){
+        if(pthread_create(&threads[i], NULL, fn, NULL)){
+            bench_fail("threads", "pthread");
+        }
+    }
+
+    for(int i = 0; i < THREADS; i++){
+        pthread_join(threads[i], NULL);
+    }
+
+    return bench_now() - start;
+}
+
+static void run_threads(void){
+    double lz = 1e30;
+    double sys = 1e30;
+
+    for(int run = 0; run < BENCH_RUNS; run++){
+        double t = run_threads_with(thread_lzarena);
+        lz = t < lz ? t : lz;
+        t = run_threads_with(thread_malloc);
+        sys = t < sys ? t : sys;
+    }
+
+    bench_report("threads", "lzarena", SMALL_OPS * THREADS, lz);
+    bench_report("threads", MALLOC_NAME, SMALL_OPS * THREADS, sys);
+}
+
+static int wants(const char *name, int argc, char **argv){
+    return argc < 2 || strcmp(argv[1], name) == 0;
+}
+
+int main(int argc, char **argv){
+    if(wants("small", argc, argv)){
+        run_sizes("small", 16, 64);
+    }
+
+    if(wants("mixed", argc, argv)){
+        run_sizes("mixed", 8, 4096);
+    }
+
+    if(wants("realloc", argc, argv)){
+        run_realloc();
+    }
+
+    if(wants("free_all", argc, argv)){
+        run_free_all();
+    }
+
+    if(wants("threads", argc, argv)){
+        run_threads();
+    }
+
+    if(wants("churn", argc, argv)){
+        run_churn();
+    }
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Every case runs BENCH_RUNS times and reports its fastest run, so numbers
+// taken before and after a change can be compared on the same machine.
+#ifndef BENCH_RUNS
+    #define BENCH_RUNS 5
+#endif
+
+#define BENCH_SEED 0x9E3779B97F4A7C15ull
+
+static inline double bench_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64, seeded the same way on every run.
+static inline uint64_t bench_next(uint64_t *state){
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
+
+// Sizes between min and max bytes, skewed towards the small end like most
+// allocation traces.
+static inline size_t bench_size(size_t min, size_t max, uint64_t *state){
+    uint64_t r = bench_next(state);
+    size_t span = max - min + 1;
+
+    return min + (size_t)((r % span) * (r % span) / span);
+}
+
+static inline void bench_report(const char *name, const char *impl, size_t ops, double seconds){
+    printf("%-12s %-16s %10.2f ns/op %12.0f ops/s\n", name, impl, seconds * 1e9 / ops, ops / seconds);
+}
+
+static inline void bench_fail(const char *name, const char *impl){
+    fprintf(stderr, "%s/%s: allocation failed\n", name, impl);
+    exit(1);
+}
+
+#endif
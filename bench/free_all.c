@@ -0,0 +1,75 @@
+// Regression benchmark for lzarena_free_all on a multi-region arena.
+//
+//     make check
+//
+// Every cycle touches every region before resetting the arena. The arena
+// capacity must stay the same from the first cycle to the last one, so the
+// program fails if any region kept a stale offset across a reset.
+
+#include "lzarena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define CYCLES 1000000
+#define ALLOCS 64
+#define ALLOC_SIZE 1000
+
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv){
+    size_t cycles = argc > 1 ? strtoul(argv[1], NULL, 10) : CYCLES;
+    LZArena *arena = lzarena_create(NULL);
+
+    if(!arena){
+        return 1;
+    }
+
+    size_t used = 0;
+    size_t base_size = 0;
+    size_t size = 0;
+    double start = now();
+
+    for(size_t cycle = 0; cycle < cycles; cycle++){
+        for(size_t i = 0; i < ALLOCS; i++){
+            char *ptr = LZARENA_ALLOC(ALLOC_SIZE, arena);
+
+            if(!ptr){
+                fprintf(stderr, "allocation failed at cycle %zu\n", cycle);
+                return 1;
+            }
+
+            ptr[0] = (char)i;
+        }
+
+        if(cycle == 0){
+            lzarena_report(&used, &base_size, arena);
+        }
+
+        lzarena_free_all(arena);
+    }
+
+    double elapsed = now() - start;
+
+    lzarena_report(&used, &size, arena);
+    lzarena_destroy(arena);
+
+    printf(
+        "%zu cycles: %.1f ns/cycle, capacity %zu -> %zu bytes\n",
+        cycles,
+        elapsed * 1e9 / cycles,
+        base_size,
+        size
+    );
+
+    if(size != base_size){
+        fprintf(stderr, "arena grew across lzarena_free_all\n");
+        return 1;
+    }
+
+    return 0;
+}
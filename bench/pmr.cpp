@@ -0,0 +1,78 @@
+// LZArena against std::pmr::monotonic_buffer_resource.
+//
+//     make && ./pmr
+//
+// Both sides get a fresh cycle every run: the arena is reset with
+// lzarena_free_all and the monotonic resource with release().
+
+#include "lzarena.hpp"
+#include "bench.h"
+#include <memory_resource>
+#include <vector>
+
+#define SMALL_OPS ((size_t)1 << 20)
+#define VECTOR_ITEMS ((size_t)1 << 20)
+
+static void *ptrs[SMALL_OPS];
+
+template<typename Alloc>
+static double small(Alloc alloc){
+    uint64_t seed = BENCH_SEED;
+    double start = bench_now();
+
+    for(size_t i = 0; i < SMALL_OPS; i++){
+        char *ptr = static_cast<char *>(alloc(bench_size(16, 64, &seed)));
+        ptr[0] = (char)i;
+        ptrs[i] = ptr;
+    }
+
+    return bench_now() - start;
+}
+
+static double vector_push(std::pmr::memory_resource *resource){
+    double start = bench_now();
+    std::pmr::vector<int> a(resource);
+    std::pmr::vector<int> b(resource);
+
+    for(size_t i = 0; i < VECTOR_ITEMS; i++){
+        a.push_back((int)i);
+        b.push_back((int)i);
+    }
+
+    return bench_now() - start;
+}
+
+int main(){
+    lz::Arena arena;
+    lz::ArenaResource arena_resource(arena);
+    std::pmr::monotonic_buffer_resource monotonic;
+    double lz_small = 1e30;
+    double pmr_small = 1e30;
+    double lz_vector = 1e30;
+    double pmr_vector = 1e30;
+
+    for(int run = 0; run < BENCH_RUNS; run++){
+        double t = small([&](size_t size){ return lz::allocate<8>(size, arena.get()); });
+        lz_small = t < lz_small ? t : lz_small;
+        arena.reset();
+
+        t = small([&](size_t size){ return monotonic.allocate(size, 8); });
+        pmr_small = t < pmr_small ? t : pmr_small;
+        monotonic.release();
+
+        t = vector_push(&arena_resource);
+        lz_vector = t < lz_vector ? t : lz_vector;
+        arena.reset();
+
+        t = vector_push(&monotonic);
+        pmr_vector = t < pmr_vector ? t : pmr_vector;
+        monotonic.release();
+    }
+
+    bench_report("small", "lzarena", SMALL_OPS, lz_small);
+    bench_report("small", "pmr::monotonic", SMALL_OPS, pmr_small);
+    bench_report("vector", "lzarena", VECTOR_ITEMS * 2, lz_vector);
+    bench_report("vector", "pmr::monotonic", VECTOR_ITEMS * 2, pmr_vector);
+
+    return 0;
+}
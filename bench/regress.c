@@ -0,0 +1,565 @@
+// Behaviour and regression checks for bugs that do not show up as a
+// slowdown.
+//
+//     make check
+//
+// Each check prints its name and fails the program when the arena hands
+// out memory it should not.
+
+#include "lzarena.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+    #include <unistd.h>
+#endif
+
+#define MIB ((size_t)1 << 20)
+#define SNAPSHOT_LOADS 20
+#define SHARED_THREADS 4
+#define SHARED_ALLOCS 10000
+#define SHARED_CYCLES 4
+#define MAP_KEYS 20000
+#define POOL_OBJECTS 100
+#define BUILDER_ITEMS 1000
+#define SHM_CAPACITY MIB
+#define SHM_NODES 10000
+
+static int failed;
+
+static void report(const char *name, int ok){
+    printf("%-24s %s\n", name, ok ? "ok" : "FAILED");
+    failed |= !ok;
+}
+
+// lzarena_free_all with LZARENA_FLAG_ZERO_ON_RESET must not leave old data
+// in the partial page at the end of the used range.
+static void zero_on_reset(void){
+    LZArenaConfig config;
+
+    lzarena_config_default(&config);
+    config.initial_size = 8 * MIB;
+    config.flags = LZARENA_FLAG_ZERO_ON_RESET;
+    config.backend = LZARENA_BACKEND_MMAP;
+
+    LZArena *arena = lzarena_create_config(&config, NULL);
+
+    if(!arena){
+        report("zero_on_reset", 0);
+        return;
+    }
+
+    size_t used = 3 * MIB + 1000;
+    memset(lzarena_alloc_align(used, 8, arena), 0xAB, used);
+    lzarena_free_all(arena);
+
+    unsigned char *ptr = lzarena_calloc_align(4 * MIB, 8, arena);
+    size_t dirty = 0;
+
+    for(size_t i = 0; ptr && i < 4 * MIB; i++){
+        dirty += ptr[i] != 0;
+    }
+
+    report("zero_on_reset", ptr && dirty == 0);
+    lzarena_destroy(arena);
+}
+
+// lzregion_calloc_align after LZREGION_FREE must zero what the region
+// handed out before.
+static void region_free_calloc(void){
+    LZRegion *region = lzregion_create(1 << 16);
+    int ok = region != NULL;
+
+    if(ok){
+        memset(lzregion_alloc_align(1000, 8, region), 0xAB, 1000);
+        LZREGION_FREE(region);
+
+        unsigned char *ptr = lzregion_calloc_align(1000, 8, region);
+
+        for(size_t i = 0; ptr && i < 1000; i++){
+            ok = ok && ptr[i] == 0;
+        }
+
+        ok = ok && ptr;
+        lzregion_destroy(region);
+    }
+
+    report("region_free_calloc", ok);
+}
+
+// Blocks aligned up to 64KiB keep their alignment when a snapshot is
+// loaded, whatever address the mapping lands at.
+static void snapshot_alignment(void){
+    const char *path = "regress.snapshot";
+    LZArenaConfig config;
+
+    lzarena_config_default(&config);
+    config.initial_size = 4 * MIB;
+
+    LZArena *arena = lzarena_create_config(&config, NULL);
+    LZArenaSnapshot *snapshots[SNAPSHOT_LOADS] = {0};
+    int ok = 0;
+
+    if(arena){
+        memset(lzarena_alloc_align(100, 8, arena), 1, 100);
+        void *root = lzarena_alloc_align(1000, 65536, arena);
+
+        memset(root, 2, 1000);
+        ok = lzarena_snapshot_save(path, root, arena) == LZARENA_OK;
+    }
+
+    for(int i = 0; ok && i < SNAPSHOT_LOADS; i++){
+        snapshots[i] = lzarena_snapshot_load(path, LZARENA_SNAPSHOT_READONLY);
+        ok = snapshots[i] && (uintptr_t)lzarena_snapshot_root(snapshots[i]) % 65536 == 0;
+    }
+
+    for(int i = 0; i < SNAPSHOT_LOADS; i++){
+        lzarena_snapshot_close(snapshots[i]);
+    }
+
+    report("snapshot_alignment", ok);
+    lzarena_destroy(arena);
+    remove(path);
+}
+
+// A child keeps working after its parent is rewound past regions the child
+// added, and never hands out memory the parent reuses.
+static void child_rewind(void){
+    LZArena *parent = lzarena_create(NULL);
+    LZArena *child = parent ? lzarena_create_child(4096, parent) : NULL;
+    int ok = child != NULL;
+
+    if(ok){
+        char *kept = lzarena_alloc_align(100, 8, child);
+        memset(kept, 1, 100);
+
+        LZArenaMark mark = lzarena_mark(parent);
+        memset(lzarena_alloc_align(8000, 8, child), 2, 8000);
+        lzarena_rewind(mark, parent);
+
+        char *reused = lzarena_alloc_align(8000, 8, parent);
+        memset(reused, 3, 8000);
+
+        char *ptr = lzarena_alloc_align(8000, 8, child);
+        ok = ptr && (ptr + 8000 <= reused || ptr >= reused + 8000);
+
+        if(ok){
+            memset(ptr, 4, 8000);
+        }
+
+        for(size_t i = 0; ok && i < 8000; i++){
+            ok = reused[i] == 3 && (i >= 100 || kept[i] == 1);
+        }
+    }
+
+    report("child_rewind", ok);
+    lzarena_destroy(parent);
+}
+
+// Shrinking or freeing a block from before a mark moves the offset below
+// the mark, and rewinding must not retire memory from there to the mark.
+static void rewind_below_mark(void){
+    LZArena *arena = lzarena_create(NULL);
+    int ok = arena != NULL;
+
+    if(ok){
+        char *ptr = lzarena_alloc_align(1000, 8, arena);
+        LZArenaMark mark = lzarena_mark(arena);
+
+        lzarena_realloc_align(ptr, 1000, 10, 8, arena);
+        lzarena_rewind(mark, arena);
+        ok = (char *)LZARENA_OFFSET(arena) == ptr + 10;
+
+        LZVec vec;
+        lzvec_init(sizeof(int), sizeof(int), arena, &vec);
+        ok = ok && lzvec_reserve(100, &vec) == LZARENA_OK;
+        mark = lzarena_mark(arena);
+        lzvec_finalize(&vec);
+        lzarena_rewind(mark, arena);
+
+        void *block = lzarena_alloc_sized(LZARENA_BIN_MAX * 2, arena);
+        mark = lzarena_mark(arena);
+        lzarena_free(block, LZARENA_BIN_MAX * 2, arena);
+        lzarena_rewind(mark, arena);
+
+        ptr = lzarena_alloc_align(1000, 8, arena);
+        ok = ok && ptr;
+
+        if(ok){
+            memset(ptr, 1, 1000);
+        }
+    }
+
+    report("rewind_below_mark", ok);
+    lzarena_destroy(arena);
+}
+
+typedef struct shared_job{
+    LZSharedArena *arena;
+    unsigned char id;
+    unsigned char *blocks[SHARED_ALLOCS];
+}SharedJob;
+
+static void *shared_worker(void *arg){
+    SharedJob *job = (SharedJob *)arg;
+
+    for(size_t i = 0; i < SHARED_ALLOCS; i++){
+        size_t size = 8 + i % 120;
+        unsigned char *ptr = lzshared_arena_alloc_align(size, 8, job->arena);
+
+        if(ptr){
+            memset(ptr, job->id, size);
+        }
+
+        job->blocks[i] = ptr;
+    }
+
+    return NULL;
+}
+
+// Threads allocating at once from one shared arena get disjoint blocks,
+// including across the regions they race to install, and free_all makes
+// the arena reusable.
+static void shared_arena(void){
+    LZSharedArena *arena = lzshared_arena_create(1 << 16, NULL);
+    static SharedJob jobs[SHARED_THREADS];
+    pthread_t threads[SHARED_THREADS];
+    int ok = arena != NULL;
+
+    for(int cycle = 0; ok && cycle < SHARED_CYCLES; cycle++){
+        int started = 0;
+
+        for(; started < SHARED_THREADS; started++){
+            jobs[started].arena = arena;
+            jobs[started].id = (unsigned char)(started + 1);
+
+            if(pthread_create(&threads[started], NULL, shared_worker, &jobs[started])){
+                ok = 0;
+                break;
+            }
+        }
+
+        for(int t = 0; t < started; t++){
+            pthread_join(threads[t], NULL);
+        }
+
+        for(int t = 0; ok && t < started; t++){
+            for(size_t i = 0; ok && i < SHARED_ALLOCS; i++){
+                unsigned char *ptr = jobs[t].blocks[i];
+                ok = ptr && ((uintptr_t)ptr & 7) == 0;
+
+                for(size_t j = 0; ok && j < 8 + i % 120; j++){
+                    ok = ptr[j] == jobs[t].id;
+                }
+            }
+        }
+
+        lzshared_arena_free_all(arena);
+    }
+
+    report("shared_arena", ok);
+    lzshared_arena_destroy(arena);
+}
+
+// Inserts through several rehashes, removes half, churns the other half's
+// slots with tombstones, and checks every key along the way. A map alone
+// in its arena must also rehash back into its first table's address.
+static void map_insert_remove(void){
+    LZArenaConfig config;
+
+    lzarena_config_default(&config);
+    config.initial_size = 4 * MIB;
+
+    LZArena *arena = lzarena_create_config(&config, NULL);
+    LZMap map;
+    int ok = arena != NULL;
+
+    if(ok){
+        lzmap_init(sizeof(uint64_t), sizeof(uint64_t), 8, NULL, NULL, arena, &map);
+    }
+
+    void *first = NULL;
+
+    for(uint64_t i = 0; ok && i < MAP_KEYS; i++){
+        uint64_t *value = lzmap_put(&i, &map);
+        ok = value && *value == 0;
+
+        if(ok){
+            *value = i * 3;
+            first = first ? first : map.ctrl;
+        }
+    }
+
+    ok = ok && map.len == MAP_KEYS && map.ctrl == first;
+
+    for(uint64_t i = 0; ok && i < MAP_KEYS; i += 2){
+        ok = lzmap_remove(&i, &map) == 1 && lzmap_remove(&i, &map) == 0;
+    }
+
+    size_t cap = map.cap;
+
+    for(uint64_t i = MAP_KEYS; ok && i < MAP_KEYS * 20; i++){
+        ok = lzmap_put(&i, &map) && lzmap_remove(&i, &map);
+    }
+
+    ok = ok && map.cap == cap && map.len == MAP_KEYS / 2;
+
+    for(uint64_t i = 0; ok && i < MAP_KEYS; i++){
+        uint64_t *value = lzmap_get(&i, &map);
+        ok = i & 1 ? value && *value == i * 3 : value == NULL;
+    }
+
+    size_t iter = 0;
+    size_t count = 0;
+    void *key;
+    void *value;
+
+    while(ok && lzmap_next(&iter, &key, &value, &map)){
+        ok = *(uint64_t *)value == *(uint64_t *)key * 3;
+        count++;
+    }
+
+    report("map_insert_remove", ok && count == MAP_KEYS / 2);
+    lzarena_destroy(arena);
+}
+
+// Objects from several slabs are aligned and disjoint, and freed objects
+// are handed out again before the slab grows.
+static void pool_reuse(void){
+    LZArena *arena = lzarena_create(NULL);
+    LZPool *pool = arena ? lzpool_create(24, 32, 16, arena) : NULL;
+    unsigned char *objects[POOL_OBJECTS];
+    int ok = pool != NULL;
+
+    for(size_t i = 0; ok && i < POOL_OBJECTS; i++){
+        objects[i] = lzpool_alloc(pool);
+        ok = objects[i] && ((uintptr_t)objects[i] & 31) == 0;
+
+        if(ok){
+            memset(objects[i], (int)i, 24);
+        }
+    }
+
+    for(size_t i = 0; ok && i < POOL_OBJECTS; i++){
+        for(size_t j = 0; ok && j < 24; j++){
+            ok = objects[i][j] == (unsigned char)i;
+        }
+    }
+
+    for(size_t i = 0; ok && i < POOL_OBJECTS; i += 2){
+        lzpool_free(objects[i], pool);
+    }
+
+    for(size_t i = POOL_OBJECTS; ok && i > 0; i -= 2){
+        ok = lzpool_alloc(pool) == objects[i - 2];
+    }
+
+    report("pool_reuse", ok);
+    lzarena_destroy(arena);
+}
+
+// lzarena_alloc_sized blocks are LZARENA_BIN_MIN aligned, small blocks are
+// reused by any size of their class, and a freed large block that is not
+// the top allocation comes back from the first-fit list.
+static void sized_reuse(void){
+    LZArena *arena = lzarena_create(NULL);
+    int ok = arena != NULL;
+
+    if(ok){
+        memset(lzarena_alloc_align(3, 1, arena), 0, 3);
+
+        char *small = lzarena_alloc_sized(100, arena);
+        ok = small && ((uintptr_t)small & (LZARENA_BIN_MIN - 1)) == 0;
+        lzarena_free(small, 100, arena);
+        ok = ok && lzarena_alloc_sized(120, arena) == small;
+
+        memset(lzarena_alloc_align(5, 1, arena), 0, 5);
+
+        char *large = lzarena_alloc_sized(LZARENA_BIN_MAX + 100, arena);
+        char *after = lzarena_alloc_sized(LZARENA_BIN_MAX + 100, arena);
+        ok = ok && large && after && ((uintptr_t)large & (LZARENA_BIN_MIN - 1)) == 0;
+
+        if(ok){
+            memset(large, 1, LZARENA_BIN_MAX + 100);
+            memset(after, 2, LZARENA_BIN_MAX + 100);
+            lzarena_free(large, LZARENA_BIN_MAX + 100, arena);
+            ok = lzarena_alloc_sized(LZARENA_BIN_MAX + 50, arena) == large;
+            memset(large, 3, LZARENA_BIN_MAX + 50);
+        }
+
+        for(size_t i = 0; ok && i < LZARENA_BIN_MAX + 100; i++){
+            ok = after[i] == 2;
+        }
+
+        for(size_t size = 1; ok && size <= LZARENA_BIN_MAX * 3; size += 61){
+            char *ptr = lzarena_alloc_sized(size, arena);
+            ok = ptr && ((uintptr_t)ptr & (LZARENA_BIN_MIN - 1)) == 0;
+
+            if(ok){
+                memset(ptr, 4, size);
+                lzarena_free(ptr, size, arena);
+            }
+        }
+    }
+
+    report("sized_reuse", ok);
+    lzarena_destroy(arena);
+}
+
+// A builder that stays the top allocation grows in place, finalize hands
+// its slack back to the bump offset, and interleaved builders still end
+// up with their own contents.
+static void builders(void){
+    LZArenaConfig config;
+
+    lzarena_config_default(&config);
+    config.initial_size = MIB;
+
+    LZArena *arena = lzarena_create_config(&config, NULL);
+    LZVec vec;
+    LZString a;
+    LZString b;
+    int ok = arena != NULL;
+
+    if(ok){
+        lzvec_init(sizeof(int), sizeof(int), arena, &vec);
+        lzstring_init(arena, &a);
+        lzstring_init(arena, &b);
+    }
+
+    void *first = NULL;
+
+    for(int i = 0; ok && i < BUILDER_ITEMS; i++){
+        int *slot = lzvec_push(&vec);
+        ok = slot != NULL;
+
+        if(ok){
+            *slot = i;
+            first = first ? first : vec.items;
+        }
+    }
+
+    int *items = ok ? lzvec_finalize(&vec) : NULL;
+    ok = ok && items == first && vec.cap == BUILDER_ITEMS;
+    ok = ok && (char *)LZARENA_OFFSET(arena) == (char *)(items + BUILDER_ITEMS);
+
+    for(int i = 0; ok && i < BUILDER_ITEMS; i++){
+        ok = items[i] == i;
+    }
+
+    for(int i = 0; ok && i < BUILDER_ITEMS; i++){
+        ok = lzstring_appendf(&a, "%d,", i) == LZARENA_OK && lzstring_push('x', &b) == LZARENA_OK;
+    }
+
+    // a grew last, so it is the top allocation and its slack goes back.
+    char *xs = ok ? lzstring_finalize(&b) : NULL;
+    char *text = ok ? lzstring_finalize(&a) : NULL;
+    ok = text && xs && strlen(text) == a.len && strlen(xs) == BUILDER_ITEMS;
+    ok = ok && strncmp(text, "0,1,2,", 6) == 0 && text[a.len - 1] == ',';
+    ok = ok && (char *)LZARENA_OFFSET(arena) == text + a.len + 1;
+
+    for(int i = 0; ok && i < BUILDER_ITEMS; i++){
+        ok = xs[i] == 'x';
+    }
+
+    report("builders", ok);
+    lzarena_destroy(arena);
+}
+
+#ifdef __linux__
+typedef struct shm_node{
+    LZArenaOffsetPtr next;
+    int value;
+}ShmNode;
+
+// Builds a list in an arena on shm memory, then walks it through a second
+// mapping of the same object. Allocations past the capacity must fail
+// without breaking smaller ones.
+static int shm_list(LZArenaShm *shm, LZArenaShm *(*attach)(LZArenaShm *shm, const char *name), const char *name){
+    LZArenaConfig config;
+
+    lzarena_config_default(&config);
+    config.initial_size = 1 << 16;
+
+    LZArena *arena = lzarena_create_config(&config, lzarena_shm_allocator(shm));
+    ShmNode *head = NULL;
+    int ok = arena != NULL;
+
+    for(int i = 0; ok && i < SHM_NODES; i++){
+        ShmNode *node = lzarena_alloc_align(sizeof(ShmNode), _Alignof(ShmNode), arena);
+        ok = node != NULL;
+
+        if(ok){
+            node->value = i;
+            lzarena_offset_set(head, &node->next);
+            head = node;
+        }
+    }
+
+    LZArenaAllocator *allocator = lzarena_shm_allocator(shm);
+    ok = ok && allocator->alloc(SHM_CAPACITY * 2, allocator->ctx) == NULL;
+    ok = ok && lzarena_alloc_align(SHM_CAPACITY, 8, arena) == NULL;
+    ok = ok && lzarena_alloc_align(100, 8, arena) != NULL;
+    lzarena_shm_set_root(head, shm);
+
+    LZArenaShm *view = ok ? attach(shm, name) : NULL;
+    const ShmNode *node = view ? lzarena_shm_root(view) : NULL;
+    int expected = SHM_NODES - 1;
+
+    ok = node && (const void *)node != (const void *)head;
+
+    for(; ok && node; node = lzarena_offset_get(&node->next)){
+        ok = node->value == expected--;
+    }
+
+    lzarena_shm_destroy(view);
+    lzarena_destroy(arena);
+
+    return ok && expected == -1;
+}
+
+static LZArenaShm *attach_fd(LZArenaShm *shm, const char *name){
+    (void)name;
+    return lzarena_shm_map(lzarena_shm_fd(shm), LZARENA_SHM_READONLY);
+}
+
+static LZArenaShm *attach_name(LZArenaShm *shm, const char *name){
+    (void)shm;
+    return lzarena_shm_open(name, LZARENA_SHM_READONLY);
+}
+
+static void shm_create_map(void){
+    char name[64];
+    LZArenaShm *memfd = lzarena_shm_create(NULL, SHM_CAPACITY);
+    int ok = memfd && shm_list(memfd, attach_fd, NULL);
+
+    lzarena_shm_destroy(memfd);
+    snprintf(name, sizeof(name), "/lzarena-regress-%ld", (long)getpid());
+
+    LZArenaShm *named = lzarena_shm_create(name, SHM_CAPACITY);
+    ok = ok && named && shm_list(named, attach_name, name);
+
+    lzarena_shm_destroy(named);
+    report("shm_create_map", ok);
+}
+#endif
+
+int main(void){
+    zero_on_reset();
+    region_free_calloc();
+    snapshot_alignment();
+    child_rewind();
+    rewind_below_mark();
+    shared_arena();
+    map_insert_remove();
+    pool_reuse();
+    sized_reuse();
+    builders();
+
+#ifdef __linux__
+    shm_create_map();
+#endif
+
+    return failed;
+}
@@ -4,359 +4,3177 @@
 #include <stdint.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdatomic.h>
+
+#if defined(__has_feature)
+    #if __has_feature(address_sanitizer)
+        #define LZARENA_ASAN 1
+    #endif
+#elif defined(__SANITIZE_ADDRESS__)
+    #define LZARENA_ASAN 1
+#endif
+
+#if defined(LZARENA_DEBUG) && defined(LZARENA_ASAN)
+    #include <sanitizer/asan_interface.h>
+#endif
+
+#ifdef LZARENA_TRACE
+    #if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        #include <intrin.h>
+    #elif defined(__x86_64__) || defined(__i386__)
+        #include <x86intrin.h>
+    #else
+        #include <time.h>
+    #endif
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86_FP) && _M_IX86_FP >= 2
+    #include <emmintrin.h>
+    #define LZMAP_SSE2 1
+#endif
+
+#if !defined(_WIN32) && (defined(__unix__) || defined(__APPLE__))
+    #include <pthread.h>
+    #define HAS_PTHREAD 1
+#endif
 
 #ifdef _WIN32
     #include <sysinfoapi.h>
     #include <windows.h>
 #elif __linux__
     #include <unistd.h>
+    #include <fcntl.h>
     #include <sys/mman.h>
+    #include <sys/syscall.h>
+#endif
+
+static atomic_size_t page_size_cache;
+static atomic_size_t granularity_cache;
+static atomic_size_t huge_page_size_cache;
+
+static void query_page_sizes(){
+#ifdef _WIN32
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+
+    size_t page_size = sysinfo.dwPageSize;
+    size_t granularity = sysinfo.dwAllocationGranularity;
+    size_t huge_page_size = GetLargePageMinimum();
+#elif __linux__
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t granularity = page_size;
+    size_t huge_page_size = LZARENA_HUGE_PAGE_SIZE;
+#else
+    size_t page_size = 4096;
+    size_t granularity = page_size;
+    size_t huge_page_size = LZARENA_HUGE_PAGE_SIZE;
+#endif
+
+    if(huge_page_size < page_size){
+        huge_page_size = LZARENA_HUGE_PAGE_SIZE;
+    }
+
+    atomic_store_explicit(&granularity_cache, granularity, memory_order_relaxed);
+    atomic_store_explicit(&huge_page_size_cache, huge_page_size, memory_order_relaxed);
+    atomic_store_explicit(&page_size_cache, page_size, memory_order_relaxed);
+}
+
+static inline size_t cached_size(atomic_size_t *cache){
+    size_t size = atomic_load_explicit(cache, memory_order_relaxed);
+
+    if(!size){
+        query_page_sizes();
+        size = atomic_load_explicit(cache, memory_order_relaxed);
+    }
+
+    return size;
+}
+
+#define PAGE_SIZE cached_size(&page_size_cache)
+#define GRANULARITY cached_size(&granularity_cache)
+#define HUGE_PAGE_SIZE cached_size(&huge_page_size_cache)
+
+#if defined(_MSC_VER)
+    #define THREAD_LOCAL __declspec(thread)
+#elif __STDC_VERSION__ >= 201112L
+    #define THREAD_LOCAL _Thread_local
+#else
+    #define THREAD_LOCAL __thread
+#endif
+
+#ifdef LZARENA_STATS
+    #define STAT(expr) (expr)
+#else
+    #define STAT(expr) ((void)0)
+#endif
+
+#ifdef LZARENA_TRACE
+static LZArenaTraceHook trace_hook;
+static void *trace_ctx;
+static THREAD_LOCAL const char *trace_current_site;
+static THREAD_LOCAL LZArenaTraceEvent trace_ring[LZARENA_TRACE_RING];
+static THREAD_LOCAL size_t trace_head;
+static THREAD_LOCAL size_t trace_len;
+
+static inline uint64_t trace_cycles(void){
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86)) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t cycles;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(cycles));
+    return cycles;
+#else
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static void trace_emit(int kind, void *ptr, size_t size, size_t old_size, size_t alignment, uint64_t start, LZArena *arena){
+    LZArenaTraceEvent event;
+
+    event.kind = kind;
+    event.site = trace_current_site;
+    event.arena = arena;
+    event.ptr = ptr;
+    event.size = size;
+    event.old_size = old_size;
+    event.alignment = alignment;
+    event.start = start;
+    event.cycles = trace_cycles() - start;
+
+    if(trace_hook){
+        trace_hook(&event, trace_ctx);
+        return;
+    }
+
+    trace_ring[trace_head] = event;
+    trace_head = (trace_head + 1) % LZARENA_TRACE_RING;
+
+    if(trace_len < LZARENA_TRACE_RING){
+        trace_len++;
+    }
+}
+
+    #define TRACE_BEGIN(start) uint64_t start = trace_cycles()
+    #define TRACE(kind, ptr, size, old_size, alignment, start, arena) \
+        trace_emit(kind, ptr, size, old_size, alignment, start, arena)
+#else
+    #define TRACE_BEGIN(start) ((void)0)
+    #define TRACE(kind, ptr, size, old_size, alignment, start, arena) ((void)0)
+#endif
+
+// LZARENA_DEBUG builds fill memory the arena takes back with
+// LZARENA_FILL_BYTE and, under AddressSanitizer, poison it along with the
+// unused tail of every region, so stale pointers fault instead of reading
+// recycled data. On the mmap backend every region is followed by a
+// PROT_NONE guard page.
+#if defined(LZARENA_DEBUG) && defined(LZARENA_ASAN)
+    #define POISON(ptr, size) ASAN_POISON_MEMORY_REGION(ptr, size)
+    #define UNPOISON(ptr, size) ASAN_UNPOISON_MEMORY_REGION(ptr, size)
+#else
+    #define POISON(ptr, size) ((void)(ptr), (void)(size))
+    #define UNPOISON(ptr, size) ((void)(ptr), (void)(size))
+#endif
+
+#ifdef LZARENA_DEBUG
+    #define FILL(ptr, size) memset(ptr, LZARENA_FILL_BYTE, size)
+#else
+    #define FILL(ptr, size) ((void)(ptr), (void)(size))
+#endif
+
+#if defined(_WIN32) || defined(__linux__)
+    #define HAS_RESERVE 1
+#endif
+
+#if defined(LZARENA_DEBUG) && defined(__linux__)
+    #define GUARD_SIZE PAGE_SIZE
+    #define GUARD_OFFSET(size) align_forward(size, PAGE_SIZE)
+#else
+    #define GUARD_SIZE 0
+    #define GUARD_OFFSET(size) (size)
+#endif
+
+#define REGION_SIZE sizeof(LZRegion)
+#define ARENA_SIZE sizeof(LZArena)
+
+#define CACHE_BUCKETS (sizeof(size_t) * 8)
+
+typedef struct region_cache{
+    size_t size;
+    size_t limit;
+    LZRegion *buckets[CACHE_BUCKETS];
+}RegionCache;
+
+static THREAD_LOCAL LZArena *scratch_arenas[LZARENA_SCRATCH_COUNT];
+static THREAD_LOCAL RegionCache region_cache = {0, LZARENA_CACHE_LIMIT, {0}};
+static THREAD_LOCAL int thread_exit_watched;
+
+// Threads that cached regions or created scratch arenas give them back when
+// they exit, through a thread exit destructor registered the first time.
+#ifdef _WIN32
+static DWORD thread_exit_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE thread_exit_once = INIT_ONCE_STATIC_INIT;
+
+static VOID WINAPI on_thread_exit(PVOID value){
+    (void)value;
+    lzarena_scratch_release();
+    lzarena_cache_trim(0);
+}
+
+static BOOL CALLBACK create_thread_exit_key(PINIT_ONCE once, PVOID param, PVOID *ctx){
+    (void)once;
+    (void)param;
+    (void)ctx;
+    thread_exit_key = FlsAlloc(on_thread_exit);
+
+    return TRUE;
+}
+#elif defined(HAS_PTHREAD)
+static pthread_key_t thread_exit_key;
+static pthread_once_t thread_exit_once = PTHREAD_ONCE_INIT;
+static int thread_exit_key_ok;
+
+static void on_thread_exit(void *value){
+    (void)value;
+    lzarena_scratch_release();
+    lzarena_cache_trim(0);
+}
+
+static void create_thread_exit_key(void){
+    thread_exit_key_ok = pthread_key_create(&thread_exit_key, on_thread_exit) == 0;
+}
+#endif
+
+static void watch_thread_exit(void){
+    if(thread_exit_watched){
+        return;
+    }
+
+    thread_exit_watched = 1;
+
+#ifdef _WIN32
+    InitOnceExecuteOnce(&thread_exit_once, create_thread_exit_key, NULL, NULL);
+
+    if(thread_exit_key != FLS_OUT_OF_INDEXES){
+        FlsSetValue(thread_exit_key, (PVOID)1);
+    }
+#elif defined(HAS_PTHREAD)
+    pthread_once(&thread_exit_once, create_thread_exit_key);
+
+    if(thread_exit_key_ok){
+        pthread_setspecific(thread_exit_key, (void *)1);
+    }
+#endif
+}
+
+static inline int is_power_of_two(uintptr_t x){
+    return (x & (x - 1)) == 0;
+}
+
+static inline uintptr_t align_forward(uintptr_t addr, size_t alignment){
+    assert(is_power_of_two(alignment));
+
+    size_t module = addr & (alignment - 1);;
+    size_t padding = module == 0 ? 0 : alignment - module;
+
+    return addr + padding;
+}
+
+// Everything from region->dirty up has never been handed out since the
+// region was mapped, so it is still zero. It has to be raised before the
+// offset moves back.
+static inline void mark_dirty(LZRegion *region){
+    if(region->offset > region->dirty){
+        region->dirty = region->offset;
+    }
+}
+
+// Called on memory the arena takes back, which is always below dirty. It
+// may still hold poisoned padding or freed blocks.
+static inline void retire_memory(void *ptr, size_t size){
+    UNPOISON(ptr, size);
+    FILL(ptr, size);
+    POISON(ptr, size);
+}
+
+static inline void retire_region(LZRegion *region){
+    retire_memory(region->chunk, (uintptr_t)region->offset - (uintptr_t)region->chunk);
+}
+
+static inline void *lzalloc(size_t size, LZArenaAllocator *allocator){
+    return allocator ? allocator->alloc(size, allocator->ctx) : malloc(size);
+}
+
+static inline void lzdealloc(void *ptr, size_t size, LZArenaAllocator *allocator){
+    if(!ptr){
+        return;
+    }
+
+    if(allocator){
+        allocator->dealloc(ptr, size, allocator->ctx);
+    }else{
+        free(ptr);
+    }
+}
+
+// User allocators may return buffers of any alignment, so objects placed in
+// them keep the buffer to give it back. Pair with free_object.
+static void *alloc_object(size_t size, void **buffer, LZArenaAllocator *allocator){
+    char *buff = (char *)lzalloc(size + LZARENA_DEFAULT_ALIGNMENT, allocator);
+
+    if(!buff){
+        return NULL;
+    }
+
+    *buffer = buff;
+
+    return (void *)align_forward((uintptr_t)buff, LZARENA_DEFAULT_ALIGNMENT);
+}
+
+static inline void free_object(void *buffer, size_t size, LZArenaAllocator *allocator){
+    lzdealloc(buffer, size + LZARENA_DEFAULT_ALIGNMENT, allocator);
+}
+
+#if defined(_WIN32) || defined(__linux__) && defined(SYS_mbind)
+static int numa_node_for(int numa_node){
+    if(numa_node != LZARENA_NUMA_LOCAL){
+        return numa_node;
+    }
+
+#ifdef _WIN32
+    UCHAR node;
+
+    return GetNumaProcessorNode((UCHAR)GetCurrentProcessorNumber(), &node) ? node : LZARENA_NUMA_NONE;
+#elif defined(__linux__) && defined(SYS_getcpu)
+    unsigned int cpu;
+    unsigned int node;
+
+    return syscall(SYS_getcpu, &cpu, &node, NULL) == 0 ? (int)node : LZARENA_NUMA_NONE;
+#else
+    return LZARENA_NUMA_NONE;
+#endif
+}
+#endif
+
+#if defined(_WIN32) || defined(__linux__)
+static void touch_memory(void *ptr, size_t size){
+    volatile char *start = (volatile char *)ptr;
+    size_t page_size = PAGE_SIZE;
+
+    for(size_t i = 0; i < size; i += page_size){
+        start[i] = 0;
+    }
+}
+#endif
+
+#ifdef __linux__
+// Applies the placement flags to a fresh mapping. NUMA policy is set before
+// populating so the prefaulted pages land on the requested node.
+static inline void place_memory(void *ptr, size_t size, int flags, int numa_node){
+#ifdef MADV_HUGEPAGE
+    if(flags & LZARENA_FLAG_THP){
+        madvise(ptr, size, MADV_HUGEPAGE);
+    }
+#endif
+
+#ifdef SYS_mbind
+    numa_node = numa_node_for(numa_node);
+
+    if(numa_node >= 0){
+        unsigned long nodemask[16] = {0};
+        size_t bits = sizeof(unsigned long) * 8;
+
+        if((size_t)numa_node < sizeof(nodemask) * 8){
+            nodemask[numa_node / bits] = 1UL << (numa_node % bits);
+            // 1 is MPOL_PREFERRED: use the node while it has free pages.
+            syscall(SYS_mbind, ptr, size, 1, nodemask, sizeof(nodemask) * 8, 0);
+        }
+    }
+#endif
+
+    if(flags & LZARENA_FLAG_POPULATE){
+#ifdef MADV_POPULATE_WRITE
+        if(madvise(ptr, size, MADV_POPULATE_WRITE) == 0){
+            return;
+        }
+#endif
+        touch_memory(ptr, size);
+    }
+}
+#endif
+
+#ifdef HAS_RESERVE
+static void *reserve_memory(size_t size){
+#ifdef _WIN32
+    return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#elif __linux__
+    void *ptr = mmap(
+        NULL,
+        size,
+        PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+
+    return ptr == MAP_FAILED ? NULL : ptr;
+#endif
+}
+
+static void release_memory(void *ptr, size_t size){
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    if(munmap(ptr, size) == -1){
+        perror(NULL);
+    }
+#endif
+}
+
+static int commit_memory(void *ptr, size_t size){
+#ifdef _WIN32
+    return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) ? LZARENA_OK : LZARENA_ERR_ALLOC;
+#else
+    return mprotect(ptr, size, PROT_READ | PROT_WRITE) == 0 ? LZARENA_OK : LZARENA_ERR_ALLOC;
+#endif
+}
+
+static void decommit_memory(void *ptr, size_t size){
+#ifdef _WIN32
+    VirtualFree(ptr, size, MEM_DECOMMIT);
+#else
+    madvise(ptr, size, MADV_DONTNEED);
+    mprotect(ptr, size, PROT_NONE);
+#endif
+}
+
+static int region_commit(uintptr_t end, LZRegion *region){
+    uintptr_t commit_start = (uintptr_t)region->commit;
+    uintptr_t chunk_end = (uintptr_t)region->chunk + region->chunk_len;
+    uintptr_t commit_end = align_forward(end, LZARENA_RESERVE_COMMIT);
+
+    if(commit_end > chunk_end){
+        commit_end = chunk_end;
+    }
+
+    if(commit_memory((void *)commit_start, commit_end - commit_start)){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    POISON((void *)commit_start, commit_end - commit_start);
+    region->commit = (void *)commit_end;
+
+    return LZARENA_OK;
+}
+
+static void region_decommit(size_t retain, LZRegion *region){
+    uintptr_t commit_end = (uintptr_t)region->commit;
+    uintptr_t keep_end = align_forward((uintptr_t)region->chunk + retain, LZARENA_RESERVE_COMMIT);
+
+    if(keep_end >= commit_end){
+        return;
+    }
+
+    UNPOISON((void *)keep_end, commit_end - keep_end);
+    decommit_memory((void *)keep_end, commit_end - keep_end);
+    region->commit = (void *)keep_end;
+
+    if((uintptr_t)region->dirty > keep_end){
+        region->dirty = (void *)keep_end;
+    }
+}
+#endif
+
+#ifdef __linux__
+static void zero_pages(LZRegion *region){
+    size_t page_size = PAGE_SIZE;
+    uintptr_t start = align_forward((uintptr_t)region->chunk, page_size);
+    // The mapping is page granular, so the page holding dirty can be
+    // dropped whole. Leaving it out would leave old data above start.
+    uintptr_t end = align_forward((uintptr_t)region->dirty, page_size);
+
+    if(end <= start || end - start < LZARENA_ZERO_THRESHOLD){
+        return;
+    }
+
+    if(madvise((void *)start, end - start, MADV_DONTNEED) == 0){
+        region->dirty = (void *)start;
+    }
+}
+#endif
+
+static inline void reset_region(LZRegion *region, LZArena *arena){
+    mark_dirty(region);
+    retire_region(region);
+    region->offset = region->chunk;
+
+#ifdef HAS_RESERVE
+    if(region->backend == LZARENA_BACKEND_RESERVE){
+        region_decommit(LZARENA_RESERVE_RETAIN, region);
+    }
+#endif
+
+#ifdef __linux__
+    if(region->backend == LZARENA_BACKEND_MMAP && (arena->config.flags & LZARENA_FLAG_ZERO_ON_RESET)){
+        zero_pages(region);
+    }
+#else
+    (void)arena;
 #endif
+}
+
+static inline size_t cache_bucket(size_t len){
+    size_t bucket = 0;
+
+    while(len >>= 1){
+        bucket++;
+    }
+
+    return bucket;
+}
+
+static inline int cacheable(LZArenaConfig *config){
+    return !config || (
+        (config->flags & ~LZARENA_FLAG_ZERO_ON_RESET) == 0 &&
+        config->numa_node == LZARENA_NUMA_NONE
+    );
+}
+
+static LZRegion *cache_take(size_t buff_len, int backend){
+    size_t bucket = cache_bucket(buff_len);
+    size_t last = bucket + 1 < CACHE_BUCKETS ? bucket + 1 : bucket;
+
+    for(; bucket <= last; bucket++){
+        LZRegion *prev = NULL;
+        LZRegion *region = region_cache.buckets[bucket];
+
+        while(region && (region->region_len < buff_len || region->backend != backend)){
+            prev = region;
+            region = region->next;
+        }
+
+        if(!region){
+            continue;
+        }
+
+        if(prev){
+            prev->next = region->next;
+        }else{
+            region_cache.buckets[bucket] = region->next;
+        }
+
+        region_cache.size -= region->region_len;
+        mark_dirty(region);
+        retire_region(region);
+        region->offset = region->chunk;
+        region->next = NULL;
+
+        return region;
+    }
+
+    return NULL;
+}
+
+static int cache_put(LZRegion *region){
+    if(region_cache.size + region->region_len > region_cache.limit){
+        return 0;
+    }
+
+    size_t bucket = cache_bucket(region->region_len);
+
+    watch_thread_exit();
+    region->next = region_cache.buckets[bucket];
+    region_cache.buckets[bucket] = region;
+    region_cache.size += region->region_len;
+
+    return 1;
+}
+
+static LZRegion *create_region(size_t buff_len, LZArenaConfig *config, LZArenaAllocator *allocator){
+    LZRegion *region = NULL;
+
+    if(!allocator){
+        region = cacheable(config) ? cache_take(buff_len, config ? config->backend : LZARENA_BACKEND) : NULL;
+
+        if(region){
+            return region;
+        }
+
+        region = config ?
+            lzregion_create_backend(buff_len, config->backend, config->flags, config->numa_node) :
+            lzregion_create(buff_len);
+    }else{
+        void *buff = lzalloc(buff_len, allocator);
+        region = buff ? lzregion_init(buff_len, buff) : NULL;
+    }
+
+    if(region){
+        POISON(region->chunk, (uintptr_t)region->commit - (uintptr_t)region->chunk);
+    }
+
+    return region;
+}
+
+static void destroy_region(LZRegion *region, LZArenaConfig *config, LZArenaAllocator *allocator){
+    if(allocator){
+        UNPOISON(region->chunk, (uintptr_t)region->commit - (uintptr_t)region->chunk);
+        lzdealloc(region->buffer, region->region_len, allocator);
+    }else if(!cacheable(config) || !cache_put(region)){
+        lzregion_destroy(region);
+    }
+}
+
+static inline size_t region_len_for(size_t size){
+    return align_forward(size + REGION_SIZE + LZARENA_DEFAULT_ALIGNMENT, GRANULARITY);
+}
+
+static inline size_t region_used(LZRegion *region){
+    return (size_t)((uintptr_t)region->offset - (uintptr_t)region->chunk);
+}
+
+#ifdef LZARENA_STATS
+// closed_used holds the bytes taken from the regions left behind this cycle
+// and from the large regions, so only the current region has to be looked at.
+static inline void count_used(LZArena *arena){
+    LZArenaStats *stats = &arena->stats;
+    LZRegion *current = arena->current;
+
+    stats->used = arena->closed_used + (current ? region_used(current) : 0);
+
+    if(stats->used > stats->peak_used){
+        stats->peak_used = stats->used;
+    }
+}
+
+static inline void count_alloc(size_t size, void *base, void *ptr, LZArena *arena){
+    arena->stats.alloc_count++;
+    arena->stats.bytes_requested += size;
+    arena->stats.bytes_padding += (uintptr_t)ptr - (uintptr_t)base;
+    count_used(arena);
+}
+#endif
+
+static inline void enter_region(LZRegion *region, LZArena *arena){
+    LZRegion *current = arena->current;
+
+    if(current){
+        arena->closed_used += region_used(current);
+        STAT(arena->stats.bytes_skipped += current->chunk_len - region_used(current));
+    }
+
+    arena->current = region;
+    arena->used_len += region->region_len;
+
+    if(arena->used_len > arena->peak_len){
+        arena->peak_len = arena->used_len;
+    }
+}
+
+static int append_region(size_t size, LZArena *arena){
+    TRACE_BEGIN(start);
+    LZArenaConfig *config = &arena->config;
+    size_t buff_len = region_len_for(size);
+
+    if(buff_len < arena->region_size){
+        buff_len = arena->region_size;
+    }
+
+	LZRegion *region = create_region(buff_len, config, arena->allocator);
+    TRACE(LZARENA_TRACE_APPEND, region, buff_len, 0, 0, start, arena);
+
+    if(!region){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    STAT(arena->stats.region_appends++);
+    STAT(arena->stats.region_count++);
+    STAT(arena->stats.size += region->chunk_len);
+
+    if(arena->region_size < config->max_region_size){
+        size_t next_size = arena->region_size * config->growth_factor;
+        arena->region_size = next_size < config->max_region_size ? next_size : config->max_region_size;
+    }
+
+    LZRegion *current = arena->current;
+
+    if(current){
+        region->next = current->next;
+        current->next = region;
+    }else{
+        arena->head = region;
+    }
+
+    if(arena->tail == current){
+        arena->tail = region;
+    }
+
+    enter_region(region, arena);
+
+    return LZARENA_OK;
+}
+
+static void *alloc_large(size_t size, size_t alignment, LZArena *arena){
+    LZRegion *region = create_region(region_len_for(size + alignment), &arena->config, arena->allocator);
+
+    if(!region){
+        return NULL;
+    }
+
+    region->next = arena->large;
+    arena->large = region;
+    STAT(arena->stats.region_count++);
+    STAT(arena->stats.size += region->chunk_len);
+
+    void *ptr = lzregion_alloc_align(size, alignment, region);
+    arena->closed_used += region_used(region);
+
+    return ptr;
+}
+
+static void release_large(LZRegion *until, LZArena *arena){
+    LZRegion *region = arena->large;
+
+    while(region != until){
+        LZRegion *next = region->next;
+        STAT(arena->stats.region_count--);
+        STAT(arena->stats.size -= region->chunk_len);
+        destroy_region(region, &arena->config, arena->allocator);
+        region = next;
+    }
+
+    arena->large = until;
+}
+
+static void run_cleanups(LZArenaCleanup *until, LZArena *arena){
+    while(arena->cleanups != until){
+        LZArenaCleanup *cleanup = arena->cleanups;
+        arena->cleanups = cleanup->next;
+        cleanup->fn(cleanup->ctx);
+    }
+}
+
+static inline size_t bin_index(size_t size){
+    size_t bin = 0;
+    size_t bin_size = LZARENA_BIN_MIN;
+
+    while(bin_size < size){
+        bin_size <<= 1;
+        bin++;
+    }
+
+    return bin;
+}
+
+typedef struct free_block FreeBlock;
+
+struct free_block{
+    size_t size;
+    FreeBlock *next;
+};
+
+static inline void clear_bins(LZArena *arena){
+    memset(arena->bins, 0, sizeof(arena->bins));
+    arena->free_blocks = NULL;
+}
+
+// Blocks bigger than the largest size class are rounded to a multiple of it
+// and reused first-fit, as long as they are less than twice the request.
+static void *take_free_block(size_t size, LZArena *arena){
+    FreeBlock *prev = NULL;
+    FreeBlock *block = (FreeBlock *)arena->free_blocks;
+
+    while(block && (block->size < size || block->size / 2 >= size)){
+        prev = block;
+        block = block->next;
+    }
+
+    if(!block){
+        return NULL;
+    }
+
+    if(prev){
+        prev->next = block->next;
+    }else{
+        arena->free_blocks = block->next;
+    }
+
+    UNPOISON(block, block->size);
+
+    return block;
+}
+
+static inline int region_fits_empty(size_t size, size_t alignment, LZRegion *region){
+    uintptr_t chunk_start = (uintptr_t)region->chunk;
+    uintptr_t chunk_end = chunk_start + region->chunk_len;
+    uintptr_t offset = align_forward(chunk_start, alignment);
+
+    return offset <= chunk_end && size <= chunk_end - offset;
+}
+
+// Regions from head up to current hold this cycle's allocations, the ones
+// after current are unused and get reset when they become current, which is
+// why lzarena_free_all only has to reset head. A region that fits the
+// request is moved right after current so the regions it jumps over stay
+// available for later allocations instead of being skipped until the next
+// lzarena_free_all.
+static LZRegion *next_region(size_t size, size_t alignment, LZArena *arena){
+    LZRegion *current = arena->current;
+    LZRegion *prev = current;
+    LZRegion *region = current ? current->next : NULL;
+
+    while(region && !region_fits_empty(size, alignment, region)){
+        prev = region;
+        region = region->next;
+    }
+
+    if(!region){
+        return append_region(size + alignment, arena) ? NULL : arena->current;
+    }
+
+    if(prev != current){
+        prev->next = region->next;
+
+        if(arena->tail == region){
+            arena->tail = prev;
+        }
+
+        region->next = current->next;
+        current->next = region;
+    }
+
+    reset_region(region, arena);
+    enter_region(region, arena);
+
+    return region;
+}
+
+LZRegion *lzregion_init(size_t buff_size, void *buffer){
+	uintptr_t buff_start = (uintptr_t)buffer;
+	uintptr_t buff_end = buff_start + buff_size;
+
+	uintptr_t region_start = align_forward(buff_start, LZARENA_DEFAULT_ALIGNMENT);
+    uintptr_t region_end = region_start + REGION_SIZE;
+    uintptr_t chunk_start = align_forward(region_end, LZARENA_DEFAULT_ALIGNMENT);
+
+    assert(chunk_start <= buff_end);
+    assert((buff_end - chunk_start) < buff_size);
+
+    size_t chunk_len = (buff_end - chunk_start);
+    LZRegion *region = (LZRegion *)region_start;
+
+    region->region_len = buff_size;
+	region->chunk_len = chunk_len;
+    region->offset = (void *)chunk_start;
+    region->chunk = (void *)chunk_start;
+    region->commit = (void *)buff_end;
+    region->dirty = (void *)buff_end;
+    region->next = NULL;
+    region->buffer = buffer;
+    region->backend = LZARENA_BACKEND_USER;
+
+    return region;
+}
+
+LZRegion *lzregion_create(size_t size){
+    return lzregion_create_flags(size, 0, LZARENA_NUMA_NONE);
+}
+
+LZRegion *lzregion_create_flags(size_t size, int flags, int numa_node){
+    return lzregion_create_backend(size, LZARENA_BACKEND, flags, numa_node);
+}
+
+#ifdef __linux__
+static char *map_region(size_t size, int huge, int flags, int numa_node){
+    char *buffer = MAP_FAILED;
+
+#if defined(MAP_HUGETLB) && !defined(LZARENA_DEBUG)
+    if(huge){
+        buffer = (char *)mmap(
+            NULL,
+            size,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+            -1,
+            0
+        );
+    }
+#endif
+
+    if(buffer == MAP_FAILED){
+        buffer = (char *)mmap(
+            NULL,
+            GUARD_OFFSET(size) + GUARD_SIZE,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS,
+            -1,
+            0
+        );
+
+        if(buffer == MAP_FAILED){
+            return NULL;
+        }
+
+        if(GUARD_SIZE && mprotect(buffer + GUARD_OFFSET(size), GUARD_SIZE, PROT_NONE) == -1){
+            munmap(buffer, GUARD_OFFSET(size) + GUARD_SIZE);
+            return NULL;
+        }
+
+        if(huge){
+            flags |= LZARENA_FLAG_THP;
+        }
+    }
+
+    place_memory(buffer, size, flags, numa_node);
+
+    return buffer;
+}
+#endif
+
+#ifdef _WIN32
+static char *virtual_alloc_region(size_t size, int huge, int flags, int numa_node){
+    char *buffer = NULL;
+    DWORD type = MEM_RESERVE | MEM_COMMIT;
+
+    numa_node = numa_node_for(numa_node);
+
+    if(huge){
+        buffer = (char *)(numa_node >= 0 ?
+            VirtualAllocExNuma(GetCurrentProcess(), NULL, size, type | MEM_LARGE_PAGES, PAGE_READWRITE, numa_node) :
+            VirtualAlloc(NULL, size, type | MEM_LARGE_PAGES, PAGE_READWRITE));
+    }
+
+    if(!buffer){
+        buffer = (char *)(numa_node >= 0 ?
+            VirtualAllocExNuma(GetCurrentProcess(), NULL, size, type, PAGE_READWRITE, numa_node) :
+            VirtualAlloc(NULL, size, type, PAGE_READWRITE));
+    }
+
+    if(buffer && (flags & LZARENA_FLAG_POPULATE)){
+        touch_memory(buffer, size);
+    }
+
+    return buffer;
+}
+#endif
+
+#ifdef HAS_RESERVE
+static char *reserve_region(size_t size, int flags, int numa_node){
+    assert(is_power_of_two(LZARENA_RESERVE_COMMIT));
+
+    char *buffer = (char *)reserve_memory(size);
+
+    if(!buffer){
+        return NULL;
+    }
+
+#ifdef __linux__
+    if(flags & LZARENA_FLAG_HUGE_PAGES){
+        flags |= LZARENA_FLAG_THP;
+    }
+
+    place_memory(buffer, size, flags & ~LZARENA_FLAG_POPULATE, numa_node);
+#else
+    (void)flags;
+    (void)numa_node;
+#endif
+
+    if(commit_memory(buffer, LZARENA_RESERVE_COMMIT)){
+        release_memory(buffer, size);
+        return NULL;
+    }
+
+    return buffer;
+}
+#endif
+
+static int backend_available(int backend){
+    switch(backend){
+        case LZARENA_BACKEND_MALLOC:
+#ifdef __linux__
+        case LZARENA_BACKEND_MMAP:
+#endif
+#ifdef _WIN32
+        case LZARENA_BACKEND_VIRTUALALLOC:
+#endif
+#ifdef HAS_RESERVE
+        case LZARENA_BACKEND_RESERVE:
+#endif
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+LZRegion *lzregion_create_backend(size_t size, int backend, int flags, int numa_node){
+    int huge = (flags & LZARENA_FLAG_HUGE_PAGES) && size >= HUGE_PAGE_SIZE;
+    char *buffer = NULL;
+
+    if(huge){
+        size = align_forward(size, HUGE_PAGE_SIZE);
+    }
+
+    switch(backend){
+        case LZARENA_BACKEND_MALLOC:
+            (void)numa_node;
+            buffer = (char *)malloc(size);
+            break;
+#ifdef __linux__
+        case LZARENA_BACKEND_MMAP:
+            buffer = map_region(size, huge, flags, numa_node);
+            break;
+#endif
+#ifdef _WIN32
+        case LZARENA_BACKEND_VIRTUALALLOC:
+            buffer = virtual_alloc_region(size, huge, flags, numa_node);
+            break;
+#endif
+#ifdef HAS_RESERVE
+        case LZARENA_BACKEND_RESERVE:
+            size = size > LZARENA_RESERVE_SIZE ? size : LZARENA_RESERVE_SIZE;
+            size = align_forward(size, LZARENA_RESERVE_COMMIT);
+            buffer = reserve_region(size, flags, numa_node);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    if(!buffer){
+        return NULL;
+    }
+
+    LZRegion *region = lzregion_init(size, buffer);
+
+    region->backend = backend;
+
+    if(backend == LZARENA_BACKEND_RESERVE){
+        region->commit = buffer + LZARENA_RESERVE_COMMIT;
+    }
+
+    if(backend != LZARENA_BACKEND_MALLOC){
+        region->dirty = region->chunk;
+    }
+
+    return region;
+}
+
+void lzregion_destroy(LZRegion *region){
+    if (!region){
+        return;
+    }
+
+    UNPOISON(region->chunk, (uintptr_t)region->commit - (uintptr_t)region->chunk);
+
+    switch(region->backend){
+        case LZARENA_BACKEND_MALLOC:
+            free(region->buffer);
+            break;
+#ifdef __linux__
+        case LZARENA_BACKEND_MMAP:
+            if(munmap(region->buffer, GUARD_OFFSET(region->region_len) + GUARD_SIZE) == -1){
+                perror(NULL);
+            }
+            break;
+#endif
+#ifdef _WIN32
+        case LZARENA_BACKEND_VIRTUALALLOC:
+            VirtualFree(region->buffer, 0, MEM_RELEASE);
+            break;
+#endif
+#ifdef HAS_RESERVE
+        case LZARENA_BACKEND_RESERVE:
+            release_memory(region->buffer, region->region_len);
+            break;
+#endif
+        default:
+            break;
+    }
+}
+
+size_t lzregion_available(LZRegion *region){
+    uintptr_t buff_start = (uintptr_t)region->offset;
+    uintptr_t buff_end = (uintptr_t)region->chunk + region->chunk_len;
+
+    assert(buff_start <= buff_end);
+
+    return buff_end - buff_start;
+}
+
+size_t lzregion_available_alignment(size_t alignment, LZRegion *region){
+    uintptr_t chunk_start = (uintptr_t)region->chunk;
+    uintptr_t chunk_end = chunk_start + region->chunk_len;
+    uintptr_t offset = (uintptr_t)region->offset;
+
+    offset = align_forward(offset, alignment);
+
+    return offset >= chunk_end ? 0 : chunk_end - offset;
+}
+
+void *lzregion_alloc_align(size_t size, size_t alignment, LZRegion *region){
+    size_t available = lzregion_available_alignment(alignment, region);
+
+    if(size > available){
+        return NULL;
+    }
+
+    uintptr_t offset = (uintptr_t)region->offset;
+
+    offset = align_forward(offset, alignment);
+
+#ifdef HAS_RESERVE
+    if(offset + size > (uintptr_t)region->commit && region_commit(offset + size, region)){
+        return NULL;
+    }
+#endif
+
+    region->offset = (void *)(offset + size);
+    UNPOISON((void *)offset, size);
+
+    return (void *)offset;
+}
+
+static void zero_block(void *ptr, size_t size, LZRegion *region){
+    uintptr_t start = (uintptr_t)ptr;
+    uintptr_t end = start + size;
+    uintptr_t dirty = region ? (uintptr_t)region->dirty : end;
+
+    if(dirty < end){
+        end = dirty > start ? dirty : start;
+    }
+
+    memset(ptr, 0, end - start);
+}
+
+void *lzregion_calloc_align(size_t size, size_t alignment, LZRegion *region){
+    void *ptr = lzregion_alloc_align(size, alignment, region);
+
+    if(ptr){
+        zero_block(ptr, size, region);
+    }
+
+    return ptr;
+}
+
+static int region_resize_top(void *ptr, size_t old_size, size_t new_size, size_t alignment, LZRegion *region){
+    uintptr_t start = (uintptr_t)ptr;
+    uintptr_t chunk_end = (uintptr_t)region->chunk + region->chunk_len;
+
+    if(!ptr || start + old_size != (uintptr_t)region->offset){
+        return 0;
+    }
+
+    if((start & (alignment - 1)) != 0 || new_size > chunk_end - start){
+        return 0;
+    }
+
+#ifdef HAS_RESERVE
+    if(start + new_size > (uintptr_t)region->commit && region_commit(start + new_size, region)){
+        return 0;
+    }
+#endif
+
+    mark_dirty(region);
+
+    if(new_size > old_size){
+        UNPOISON((void *)(start + old_size), new_size - old_size);
+    }else{
+        retire_memory((void *)(start + new_size), old_size - new_size);
+    }
+
+    region->offset = (void *)(start + new_size);
+
+    return 1;
+}
+
+void *lzregion_realloc_align(void *ptr, size_t old_size, size_t new_size, size_t alignment, LZRegion *region){
+    if(region_resize_top(ptr, old_size, new_size, alignment, region)){
+        return ptr;
+    }
+
+    if(new_size <= old_size){
+        return ptr;
+    }
+
+	void *new_ptr = lzregion_alloc_align(new_size, alignment, region);
+
+	if(new_ptr && ptr){
+        memcpy(new_ptr, ptr, old_size);
+    }
+
+    return new_ptr;
+}
+
+void lzarena_config_default(LZArenaConfig *config){
+    config->initial_size = PAGE_SIZE * LZARENA_DEFAULT_FACTOR;
+    config->growth_factor = LZARENA_DEFAULT_GROWTH;
+    config->max_region_size = LZARENA_DEFAULT_MAX_REGION;
+    config->large_size = LZARENA_DEFAULT_LARGE;
+    config->flags = 0;
+    config->numa_node = LZARENA_NUMA_NONE;
+    config->trim_factor = 0;
+    config->backend = LZARENA_BACKEND;
+}
+
+LZArena *lzarena_create(LZArenaAllocator *allocator){
+    return lzarena_create_config(NULL, allocator);
+}
+
+LZArena *lzarena_create_config(const LZArenaConfig *config, LZArenaAllocator *allocator){
+    void *buffer = NULL;
+    LZArena *arena = (LZArena *)alloc_object(ARENA_SIZE, &buffer, allocator);
+
+    if (!arena){
+        return NULL;
+    }
+
+    arena->buffer = buffer;
+
+    if(config){
+        arena->config = *config;
+    }else{
+        lzarena_config_default(&arena->config);
+    }
+
+    if(!allocator && !backend_available(arena->config.backend)){
+        free_object(buffer, ARENA_SIZE, allocator);
+        return NULL;
+    }
+
+    if(arena->config.growth_factor == 0){
+        arena->config.growth_factor = 1;
+    }
+
+    if(arena->config.max_region_size < arena->config.initial_size){
+        arena->config.max_region_size = arena->config.initial_size;
+    }
+
+    arena->region_size = arena->config.initial_size;
+    arena->used_len = 0;
+    arena->peak_len = 0;
+    arena->avg_peak = 0;
+    arena->head = NULL;
+    arena->tail = NULL;
+    arena->current = NULL;
+    arena->large = NULL;
+    arena->cleanups = NULL;
+    arena->allocator = allocator;
+    arena->closed_used = 0;
+    memset(&arena->stats, 0, sizeof(arena->stats));
+    clear_bins(arena);
+
+    return arena;
+}
+
+void lzarena_destroy(LZArena *arena){
+    if(!arena){
+        return;
+    }
+
+    run_cleanups(NULL, arena);
+
+    LZArenaAllocator *allocator = arena->allocator;
+    LZRegion *current = arena->head;
+
+    while(current){
+		LZRegion *next = current->next;
+        destroy_region(current, &arena->config, allocator);
+		current = next;
+	}
+
+    release_large(NULL, arena);
+    free_object(arena->buffer, ARENA_SIZE, allocator);
+}
+
+// Lives in the parent next to the child. The defer registered on the
+// parent only destroys the child if it was not destroyed already, which
+// child_dealloc notices when the child hands back its own LZArena.
+typedef struct child_link{
+    LZArenaAllocator allocator;
+    LZArena *parent;
+    LZArena *child;
+}ChildLink;
+
+typedef struct child_region{
+    ChildLink *link;
+    void *buffer;
+}ChildRegion;
+
+// Runs when the parent is rewound past the point where it handed buffer to
+// the child, or reset. The region is taken out of the child so the child
+// never touches memory the parent reuses: cleanups whose records live in
+// it run, and if it held allocations the child moves back to the region
+// it was in before. Regions are dropped newest first, so the one in use is
+// always current and head goes last.
+static void drop_child_region(void *ctx){
+    ChildRegion *record = (ChildRegion *)ctx;
+    LZArena *child = record->link->child;
+
+    if(!child){
+        return;
+    }
+
+    for(LZRegion **large = &child->large; *large; large = &(*large)->next){
+        LZRegion *region = *large;
+
+        if(region->buffer == record->buffer){
+            *large = region->next;
+            child->closed_used -= region_used(region);
+            STAT(child->stats.region_count--);
+            STAT(child->stats.size -= region->chunk_len);
+            STAT(count_used(child));
+            return;
+        }
+    }
+
+    LZRegion *prev = NULL;
+    LZRegion *region = child->head;
+    int used = 1;
+
+    while(region && region->buffer != record->buffer){
+        used = used && region != child->current;
+        prev = region;
+        region = region->next;
+    }
+
+    if(!region){
+        return;
+    }
+
+    if(used){
+        uintptr_t start = (uintptr_t)region->chunk;
+        uintptr_t end = start + region->chunk_len;
+        LZArenaCleanup **at = &child->cleanups;
+
+        while(*at){
+            LZArenaCleanup *cleanup = *at;
+
+            if((uintptr_t)cleanup >= start && (uintptr_t)cleanup < end){
+                *at = cleanup->next;
+                cleanup->fn(cleanup->ctx);
+            }else{
+                at = &cleanup->next;
+            }
+        }
+
+        clear_bins(child);
+        child->used_len -= region->region_len;
+
+        if(region == child->current){
+            child->current = prev;
+            child->closed_used -= prev ? region_used(prev) : 0;
+        }else{
+            child->closed_used -= region_used(region);
+        }
+    }
+
+    if(prev){
+        prev->next = region->next;
+    }else{
+        child->head = region->next;
+    }
+
+    if(child->tail == region){
+        child->tail = prev;
+    }
+
+    if(!child->current){
+        child->used_len = 0;
+        child->closed_used = 0;
+    }
+
+    STAT(child->stats.region_count--);
+    STAT(child->stats.size -= region->chunk_len);
+    STAT(count_used(child));
+}
+
+// Every region handed to a live child gets a defer on the parent that
+// takes it out of the child again.
+static void *child_alloc(size_t size, void *ctx){
+    ChildLink *link = (ChildLink *)ctx;
+    void *ptr = lzarena_alloc_align(size, LZARENA_DEFAULT_ALIGNMENT, link->parent);
+
+    if(!ptr || !link->child){
+        return ptr;
+    }
+
+    ChildRegion *record = (ChildRegion *)lzarena_alloc_align(sizeof(ChildRegion), LZARENA_DEFAULT_ALIGNMENT, link->parent);
+
+    if(!record){
+        return NULL;
+    }
+
+    record->link = link;
+    record->buffer = ptr;
+
+    return lzarena_defer(drop_child_region, record, link->parent) ? NULL : ptr;
+}
+
+static void *child_realloc(void *ptr, size_t old_size, size_t new_size, void *ctx){
+    return lzarena_realloc_align(ptr, old_size, new_size, LZARENA_DEFAULT_ALIGNMENT, ((ChildLink *)ctx)->parent);
+}
+
+// Memory goes back to the parent only when it is the parent's top block,
+// everything else is reclaimed with the parent.
+static void child_dealloc(void *ptr, size_t size, void *ctx){
+    ChildLink *link = (ChildLink *)ctx;
+
+    if(link->child && ptr == link->child->buffer){
+        link->child = NULL;
+    }
+
+    lzarena_realloc_align(ptr, size, 0, LZARENA_DEFAULT_ALIGNMENT, link->parent);
+}
+
+static void destroy_child(void *ctx){
+    lzarena_destroy(((ChildLink *)ctx)->child);
+}
+
+LZArena *lzarena_create_child(size_t initial_size, LZArena *parent){
+    ChildLink *link = (ChildLink *)lzarena_alloc_align(sizeof(ChildLink), LZARENA_DEFAULT_ALIGNMENT, parent);
+
+    if(!link){
+        return NULL;
+    }
+
+    LZArenaConfig config;
+
+    lzarena_config_default(&config);
+    config.initial_size = initial_size ? initial_size : config.initial_size;
+    link->allocator.ctx = link;
+    link->allocator.alloc = child_alloc;
+    link->allocator.realloc = child_realloc;
+    link->allocator.dealloc = child_dealloc;
+    link->parent = parent;
+    link->child = lzarena_create_config(&config, &link->allocator);
+
+    if(!link->child){
+        return NULL;
+    }
+
+    LZArena *child = link->child;
+
+    if(lzarena_defer(destroy_child, link, parent)){
+        lzarena_destroy(child);
+        return NULL;
+    }
+
+    return child;
+}
+
+void lzarena_report(size_t *used, size_t *size, LZArena *arena){
+    size_t u = 0;
+    size_t s = 0;
+    int unused = 0;
+    LZRegion *current = arena->head;
+
+    // Regions past current keep their old offsets until they are reused.
+    while(current){
+		LZRegion *next = current->next;
+		u += unused ? 0 : region_used(current);
+		s += current->chunk_len;
+		unused = unused || current == arena->current;
+		current = next;
+	}
+
+    for(current = arena->large; current; current = current->next){
+        u += region_used(current);
+        s += current->chunk_len;
+    }
+
+	*used = u;
+	*size = s;
+}
+
+void lzarena_free_all(LZArena *arena){
+    TRACE_BEGIN(start);
+    run_cleanups(NULL, arena);
+    release_large(NULL, arena);
+    clear_bins(arena);
+
+    if(!arena->current){
+        TRACE(LZARENA_TRACE_FREE_ALL, NULL, 0, 0, 0, start, arena);
+        return;
+    }
+
+#ifdef LZARENA_DEBUG
+    for(LZRegion *region = arena->head; region != arena->current; region = region->next){
+        mark_dirty(region->next);
+        retire_region(region->next);
+    }
+#endif
+
+    reset_region(arena->head, arena);
+    arena->current = arena->head;
+    arena->closed_used = 0;
+    STAT(arena->stats.resets++);
+    STAT(count_used(arena));
+    arena->avg_peak = (arena->avg_peak * 3 + arena->peak_len) / 4;
+    arena->used_len = arena->head->region_len;
+    arena->peak_len = arena->used_len;
+
+    if(arena->config.trim_factor){
+        lzarena_trim(arena->avg_peak * arena->config.trim_factor, arena);
+    }
+
+    TRACE(LZARENA_TRACE_FREE_ALL, NULL, 0, 0, 0, start, arena);
+}
+
+void lzarena_stats(LZArenaStats *stats, LZArena *arena){
+    *stats = arena->stats;
+}
+
+void lzarena_trim(size_t keep, LZArena *arena){
+    LZArenaAllocator *allocator = arena->allocator;
+    LZRegion *prev = NULL;
+    LZRegion *region = arena->head;
+    size_t kept = 0;
+    int unused = 0;
+
+    while(region){
+        LZRegion *next = region->next;
+
+        if(unused && kept + region->region_len > keep){
+            prev->next = next;
+
+            if(arena->tail == region){
+                arena->tail = prev;
+            }
+
+            STAT(arena->stats.region_count--);
+            STAT(arena->stats.size -= region->chunk_len);
+
+            if(allocator){
+                UNPOISON(region->chunk, (uintptr_t)region->commit - (uintptr_t)region->chunk);
+                lzdealloc(region->buffer, region->region_len, allocator);
+            }else{
+                lzregion_destroy(region);
+            }
+        }else{
+            kept += region->region_len;
+            prev = region;
+        }
+
+        unused = unused || region == arena->current;
+        region = next;
+    }
+}
+
+LZArenaMark lzarena_mark(LZArena *arena){
+    LZArenaMark mark = {0};
+    LZRegion *current = arena->current;
+
+    mark.large = arena->large;
+    mark.cleanups = arena->cleanups;
+    mark.used_len = arena->used_len;
+    mark.closed_used = arena->closed_used;
+
+    if(current){
+        mark.region = current;
+        mark.offset = current->offset;
+    }
+
+    return mark;
+}
+
+void lzarena_rewind(LZArenaMark mark, LZArena *arena){
+    run_cleanups(mark.cleanups, arena);
+    release_large(mark.large, arena);
+    clear_bins(arena);
+
+    if(mark.region){
+#ifdef LZARENA_DEBUG
+        for(LZRegion *region = mark.region; region != arena->current; region = region->next){
+            mark_dirty(region->next);
+            retire_region(region->next);
+        }
+#endif
+
+        uintptr_t offset = (uintptr_t)mark.region->offset;
+
+        mark_dirty(mark.region);
+
+        // Blocks from before the mark that were shrunk or freed since can
+        // leave the offset below it.
+        if(offset > (uintptr_t)mark.offset){
+            retire_memory(mark.offset, offset - (uintptr_t)mark.offset);
+            mark.region->offset = mark.offset;
+        }
+        arena->current = mark.region;
+        arena->used_len = mark.used_len;
+        arena->closed_used = mark.closed_used;
+        STAT(count_used(arena));
+    }else if(arena->head){
+        reset_region(arena->head, arena);
+        arena->current = arena->head;
+        arena->used_len = arena->head->region_len;
+        arena->closed_used = 0;
+        STAT(count_used(arena));
+    }
+}
+
+void lzarena_cache_set_limit(size_t limit){
+    region_cache.limit = limit;
+    lzarena_cache_trim(limit);
+}
+
+void lzarena_cache_trim(size_t keep){
+    for(size_t bucket = CACHE_BUCKETS; bucket > 0 && region_cache.size > keep; bucket--){
+        LZRegion **head = &region_cache.buckets[bucket - 1];
+
+        while(*head && region_cache.size > keep){
+            LZRegion *region = *head;
+
+            *head = region->next;
+            region_cache.size -= region->region_len;
+            lzregion_destroy(region);
+        }
+    }
+}
+
+size_t lzarena_cache_size(void){
+    return region_cache.size;
+}
+
+LZArenaScratch lzarena_scratch_begin(size_t count, LZArena **conflicts){
+    LZArenaScratch scratch = {0};
+
+    for(size_t i = 0; i < LZARENA_SCRATCH_COUNT; i++){
+        LZArena *arena = scratch_arenas[i];
+        size_t j = 0;
+
+        while(arena && j < count && conflicts[j] != arena){
+            j++;
+        }
+
+        if(arena && j < count){
+            continue;
+        }
+
+        if(!arena){
+            arena = lzarena_create(NULL);
+
+            if(!arena){
+                return scratch;
+            }
+
+            scratch_arenas[i] = arena;
+            watch_thread_exit();
+        }
+
+        scratch.arena = arena;
+        scratch.mark = lzarena_mark(arena);
+
+        break;
+    }
+
+    return scratch;
+}
+
+void lzarena_scratch_end(LZArenaScratch scratch){
+    if(scratch.arena){
+        lzarena_rewind(scratch.mark, scratch.arena);
+    }
+}
+
+void lzarena_scratch_release(void){
+    for(size_t i = 0; i < LZARENA_SCRATCH_COUNT; i++){
+        lzarena_destroy(scratch_arenas[i]);
+        scratch_arenas[i] = NULL;
+    }
+}
+
+int lzarena_defer(void (*fn)(void *ctx), void *ctx, LZArena *arena){
+    LZArenaCleanup *cleanup = (LZArenaCleanup *)lzarena_alloc_align(
+        sizeof(LZArenaCleanup),
+        LZARENA_DEFAULT_ALIGNMENT,
+        arena
+    );
+
+    if(!cleanup){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    cleanup->fn = fn;
+    cleanup->ctx = ctx;
+    cleanup->next = arena->cleanups;
+    arena->cleanups = cleanup;
+
+    return LZARENA_OK;
+}
+
+static void forget_pool(void *ctx){
+    LZPool *pool = (LZPool *)ctx;
+
+    pool->free = NULL;
+    pool->slab = NULL;
+    pool->slab_end = NULL;
+}
+
+LZPool *lzpool_create(size_t obj_size, size_t alignment, size_t slab_count, LZArena *arena){
+    assert(is_power_of_two(alignment));
+
+    LZPool *pool = (LZPool *)lzarena_alloc_align(sizeof(LZPool), LZARENA_DEFAULT_ALIGNMENT, arena);
+
+    if(!pool){
+        return NULL;
+    }
+
+    if(alignment < sizeof(void *)){
+        alignment = sizeof(void *);
+    }
+
+    obj_size = obj_size > sizeof(void *) ? obj_size : sizeof(void *);
+
+    pool->obj_size = align_forward(obj_size, alignment);
+    pool->alignment = alignment;
+    pool->slab_count = slab_count ? slab_count : LZPOOL_DEFAULT_SLAB;
+    pool->free = NULL;
+    pool->slab = NULL;
+    pool->slab_end = NULL;
+    pool->arena = arena;
+
+    return pool;
+}
+
+void *lzpool_alloc_slab(LZPool *pool){
+    size_t slab_len = pool->obj_size * pool->slab_count;
+    char *slab = (char *)lzarena_alloc_align(slab_len, pool->alignment, pool->arena);
+
+    if(!slab || lzarena_defer(forget_pool, pool, pool->arena)){
+        return NULL;
+    }
+
+    pool->slab = slab + pool->obj_size;
+    pool->slab_end = slab + slab_len;
+
+    return slab;
+}
+
+static void *alloc_align(size_t size, size_t alignment, LZArena *arena){
+    LZRegion *current = arena->current;
+    void *ptr;
+
+    if(current){
+#ifdef LZARENA_STATS
+        void *base = current->offset;
+#endif
+        ptr = lzregion_alloc_align(size, alignment, current);
+
+        if(ptr){
+            STAT(count_alloc(size, base, ptr, arena));
+            return ptr;
+        }
+    }
+
+    if(arena->config.large_size && size >= arena->config.large_size){
+        ptr = alloc_large(size, alignment, arena);
+        STAT(ptr ? count_alloc(size, arena->large->chunk, ptr, arena) : (void)0);
+        return ptr;
+    }
+
+    current = next_region(size, alignment, arena);
+
+    if(!current){
+        return NULL;
+    }
+
+    ptr = lzregion_alloc_align(size, alignment, current);
+    STAT(ptr ? count_alloc(size, current->chunk, ptr, arena) : (void)0);
+
+    return ptr;
+}
+
+void *lzarena_alloc_align(size_t size, size_t alignment, LZArena *arena){
+    TRACE_BEGIN(start);
+    void *ptr = alloc_align(size, alignment, arena);
+    TRACE(LZARENA_TRACE_ALLOC, ptr, size, 0, alignment, start, arena);
+
+    return ptr;
+}
+
+static inline int region_contains(void *ptr, LZRegion *region){
+    uintptr_t chunk_start = (uintptr_t)region->chunk;
+    uintptr_t addr = (uintptr_t)ptr;
+
+    return addr >= chunk_start && addr - chunk_start < region->chunk_len;
+}
+
+void *lzarena_calloc_align(size_t size, size_t alignment, LZArena *arena){
+    void *ptr = lzarena_alloc_align(size, alignment, arena);
+
+    if(!ptr){
+        return NULL;
+    }
+
+    LZRegion *region = arena->current;
+
+    if(!region || !region_contains(ptr, region)){
+        region = arena->large && region_contains(ptr, arena->large) ? arena->large : NULL;
+    }
+
+    zero_block(ptr, size, region);
+
+    return ptr;
+}
+
+int lzarena_alloc_batch(size_t count, const size_t *sizes, size_t alignment, void **out, LZArena *arena){
+    if(count == 0){
+        return LZARENA_OK;
+    }
+
+    size_t total = 0;
+
+    for(size_t i = 0; i < count; i++){
+        size_t size = i + 1 < count ? align_forward(sizes[i], alignment) : sizes[i];
+
+        if(size < sizes[i] || total + size < total){
+            return LZARENA_ERR_ALLOC;
+        }
+
+        total += size;
+    }
+
+    char *ptr = (char *)lzarena_alloc_align(total, alignment, arena);
+
+    if(!ptr){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    for(size_t i = 0; i < count; i++){
+        out[i] = ptr;
+        ptr += align_forward(sizes[i], alignment);
+    }
+
+    return LZARENA_OK;
+}
+
+void *lzarena_alloc_sized(size_t size, LZArena *arena){
+    if(size > LZARENA_BIN_MAX){
+        size = align_forward(size, LZARENA_BIN_MAX);
+
+        void *ptr = take_free_block(size, arena);
+        return ptr ? ptr : lzarena_alloc_align(size, LZARENA_BIN_MIN, arena);
+    }
+
+    size_t bin = bin_index(size);
+    void *ptr = arena->bins[bin];
+
+    if(ptr){
+        UNPOISON(ptr, (size_t)LZARENA_BIN_MIN << bin);
+        arena->bins[bin] = *(void **)ptr;
+        return ptr;
+    }
+
+    return lzarena_alloc_align((size_t)LZARENA_BIN_MIN << bin, LZARENA_BIN_MIN, arena);
+}
+
+void lzarena_free(void *ptr, size_t size, LZArena *arena){
+    if(!ptr){
+        return;
+    }
+
+    if(size > LZARENA_BIN_MAX){
+        LZRegion *current = arena->current;
+
+        size = align_forward(size, LZARENA_BIN_MAX);
+
+        if(current && region_resize_top(ptr, size, 0, LZARENA_BIN_MIN, current)){
+            STAT(count_used(arena));
+            return;
+        }
+
+        FreeBlock *block = (FreeBlock *)ptr;
+
+        retire_memory(block + 1, size - sizeof(FreeBlock));
+        block->size = size;
+        block->next = (FreeBlock *)arena->free_blocks;
+        arena->free_blocks = block;
+
+        return;
+    }
+
+    size_t bin = bin_index(size);
+
+    FILL(ptr, (size_t)LZARENA_BIN_MIN << bin);
+    *(void **)ptr = arena->bins[bin];
+    arena->bins[bin] = ptr;
+    POISON(ptr, (size_t)LZARENA_BIN_MIN << bin);
+}
+
+static void *realloc_align(void *ptr, size_t old_size, size_t new_size, size_t alignment, LZArena *arena){
+    LZRegion *current = arena->current;
+
+    if(current && region_resize_top(ptr, old_size, new_size, alignment, current)){
+        STAT(arena->stats.realloc_inplace++);
+        STAT(count_used(arena));
+        return ptr;
+    }
+
+    if(new_size <= old_size){
+        return ptr;
+    }
+
+	void *new_ptr = alloc_align(new_size, alignment, arena);
+
+	if(new_ptr && ptr){
+        memcpy(new_ptr, ptr, old_size);
+        STAT(arena->stats.realloc_copies++);
+    }
+
+    return new_ptr;
+}
+
+void *lzarena_realloc_align(void *ptr, size_t old_size, size_t new_size, size_t alignment, LZArena *arena){
+    TRACE_BEGIN(start);
+    void *new_ptr = realloc_align(ptr, old_size, new_size, alignment, arena);
+    TRACE(ptr && new_ptr && new_ptr != ptr ? LZARENA_TRACE_REALLOC_COPY : LZARENA_TRACE_REALLOC,
+        new_ptr, new_size, old_size, alignment, start, arena);
+
+    return new_ptr;
+}
+
+#ifdef LZARENA_TRACE
+void lzarena_trace_hook(LZArenaTraceHook hook, void *ctx){
+    trace_hook = hook;
+    trace_ctx = ctx;
+}
+
+const char *lzarena_trace_site(const char *site){
+    const char *prev = trace_current_site;
+    trace_current_site = site;
+
+    return prev;
+}
+
+size_t lzarena_trace_read(LZArenaTraceEvent *events, size_t max){
+    size_t count = trace_len < max ? trace_len : max;
+    size_t first = (trace_head + LZARENA_TRACE_RING - trace_len) % LZARENA_TRACE_RING;
+
+    for(size_t i = 0; i < count; i++){
+        events[i] = trace_ring[(first + i) % LZARENA_TRACE_RING];
+    }
+
+    trace_len -= count;
+
+    return count;
+}
+
+void *lzarena_alloc_align_at(size_t size, size_t alignment, const char *site, LZArena *arena){
+    const char *prev = lzarena_trace_site(site);
+    void *ptr = lzarena_alloc_align(size, alignment, arena);
+    trace_current_site = prev;
+
+    return ptr;
+}
+
+void *lzarena_realloc_align_at(void *ptr, size_t old_size, size_t new_size, size_t alignment, const char *site, LZArena *arena){
+    const char *prev = lzarena_trace_site(site);
+    void *new_ptr = lzarena_realloc_align(ptr, old_size, new_size, alignment, arena);
+    trace_current_site = prev;
+
+    return new_ptr;
+}
+#endif
+
+// Grows a builder buffer to at least min_cap items, doubling its capacity.
+static int grow_buffer(size_t min_cap, size_t min_start, size_t item_size, size_t alignment, void **items, size_t *cap, LZArena *arena){
+    size_t new_cap = *cap ? *cap * 2 : min_start;
+
+    if(new_cap < *cap || new_cap < min_cap){
+        new_cap = min_cap;
+    }
+
+    if(new_cap > SIZE_MAX / item_size){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    void *new_items = lzarena_realloc_align(*items, *cap * item_size, new_cap * item_size, alignment, arena);
+
+    if(!new_items){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    *items = new_items;
+    *cap = new_cap;
+
+    return LZARENA_OK;
+}
+
+void lzvec_init(size_t item_size, size_t alignment, LZArena *arena, LZVec *vec){
+    assert(item_size > 0 && is_power_of_two(alignment));
+
+    vec->items = NULL;
+    vec->len = 0;
+    vec->cap = 0;
+    vec->item_size = item_size;
+    vec->alignment = alignment;
+    vec->arena = arena;
+}
+
+int lzvec_reserve(size_t cap, LZVec *vec){
+    if(cap <= vec->cap){
+        return LZARENA_OK;
+    }
+
+    return grow_buffer(cap, LZVEC_MIN_CAPACITY, vec->item_size, vec->alignment, &vec->items, &vec->cap, vec->arena);
+}
+
+int lzvec_append(const void *items, size_t count, LZVec *vec){
+    if(count > SIZE_MAX - vec->len || lzvec_reserve(vec->len + count, vec)){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    if(count){
+        memcpy((char *)vec->items + vec->len * vec->item_size, items, count * vec->item_size);
+        vec->len += count;
+    }
+
+    return LZARENA_OK;
+}
+
+void *lzvec_finalize(LZVec *vec){
+    if(vec->len < vec->cap){
+        size_t size = vec->item_size;
+
+        lzarena_realloc_align(vec->items, vec->cap * size, vec->len * size, vec->alignment, vec->arena);
+        vec->cap = vec->len;
+    }
+
+    return vec->items;
+}
+
+void lzstring_init(LZArena *arena, LZString *str){
+    str->buf = NULL;
+    str->len = 0;
+    str->cap = 0;
+    str->arena = arena;
+}
+
+int lzstring_reserve(size_t cap, LZString *str){
+    if(cap == SIZE_MAX){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    if(cap < str->cap){
+        return LZARENA_OK;
+    }
+
+    void *buf = str->buf;
+
+    if(grow_buffer(cap + 1, LZSTRING_MIN_CAPACITY, 1, 1, &buf, &str->cap, str->arena)){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    str->buf = (char *)buf;
+
+    return LZARENA_OK;
+}
+
+int lzstring_append(const char *chars, size_t len, LZString *str){
+    if(len > SIZE_MAX - 1 - str->len || lzstring_reserve(str->len + len, str)){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    if(len){
+        memcpy(str->buf + str->len, chars, len);
+        str->len += len;
+    }
+
+    return LZARENA_OK;
+}
+
+int lzstring_vappendf(LZString *str, const char *format, va_list args){
+    va_list copy;
+    size_t room = str->cap > str->len ? str->cap - str->len : 0;
+
+    va_copy(copy, args);
+    int len = vsnprintf(str->buf ? str->buf + str->len : NULL, room, format, copy);
+    va_end(copy);
+
+    if(len < 0){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    if((size_t)len >= room){
+        if(lzstring_reserve(str->len + (size_t)len, str)){
+            return LZARENA_ERR_ALLOC;
+        }
+
+        vsnprintf(str->buf + str->len, str->cap - str->len, format, args);
+    }
+
+    str->len += (size_t)len;
+
+    return LZARENA_OK;
+}
+
+int lzstring_appendf(LZString *str, const char *format, ...){
+    va_list args;
+
+    va_start(args, format);
+    int result = lzstring_vappendf(str, format, args);
+    va_end(args);
+
+    return result;
+}
+
+char *lzstring_finalize(LZString *str){
+    if(lzstring_reserve(str->len, str)){
+        return NULL;
+    }
+
+    str->buf[str->len] = '\0';
+
+    if(str->len + 1 < str->cap){
+        lzarena_realloc_align(str->buf, str->cap, str->len + 1, 1, str->arena);
+        str->cap = str->len + 1;
+    }
+
+    return str->buf;
+}
+
+#define MAP_GROUP 16
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+
+// Bit i of the result is set when control byte i of the group is byte.
+static inline unsigned group_match(const unsigned char *ctrl, unsigned char byte){
+#ifdef LZMAP_SSE2
+    __m128i group = _mm_load_si128((const __m128i *)ctrl);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    unsigned mask = 0;
+
+    for(unsigned i = 0; i < MAP_GROUP; i++){
+        mask |= (unsigned)(ctrl[i] == byte) << i;
+    }
+
+    return mask;
+#endif
+}
+
+// Empty and deleted slots, the only control bytes with the top bit set.
+static inline unsigned group_free(const unsigned char *ctrl){
+#ifdef LZMAP_SSE2
+    return (unsigned)_mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+    unsigned mask = 0;
+
+    for(unsigned i = 0; i < MAP_GROUP; i++){
+        mask |= (unsigned)(ctrl[i] >> 7) << i;
+    }
+
+    return mask;
+#endif
+}
+
+static inline unsigned first_bit(unsigned mask){
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctz(mask);
+#else
+    unsigned i = 0;
+
+    while(!(mask & 1)){
+        mask >>= 1;
+        i++;
+    }
+
+    return i;
+#endif
+}
+
+static inline size_t map_max_load(size_t cap){
+    return cap - cap / 8;
+}
+
+static inline size_t map_alignment(const LZMap *map){
+    return map->alignment > MAP_GROUP ? map->alignment : MAP_GROUP;
+}
+
+static inline void *map_key(size_t slot, const LZMap *map){
+    return (char *)map->keys + slot * map->key_size;
+}
+
+static inline void *map_value(size_t slot, const LZMap *map){
+    return (char *)map->values + slot * map->value_size;
+}
+
+static inline int map_keys_equal(const void *a, const void *b, const LZMap *map){
+    return map->equal ? map->equal(a, b, map->key_size) : memcmp(a, b, map->key_size) == 0;
+}
+
+// Offsets of the key and value arrays in a table of cap slots, and the
+// size of the whole table.
+static int map_layout(size_t cap, size_t *keys_at, size_t *values_at, size_t *size, const LZMap *map){
+    size_t alignment = map->alignment;
+
+    if(map->key_size > (SIZE_MAX / 2 - cap) / cap || map->value_size > (SIZE_MAX / 2 - cap) / cap){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    *keys_at = align_forward(cap, alignment);
+    *values_at = align_forward(*keys_at + cap * map->key_size, alignment);
+    *size = *values_at + cap * map->value_size;
+
+    return LZARENA_OK;
+}
+
+static size_t map_find(const void *key, uint64_t hash, const LZMap *map){
+    if(!map->ctrl){
+        return SIZE_MAX;
+    }
+
+    size_t mask = map->cap / MAP_GROUP - 1;
+    size_t group = (size_t)(hash >> 7) & mask;
+    unsigned char h2 = (unsigned char)(hash & 0x7F);
+
+    for(size_t step = 1;; step++){
+        const unsigned char *ctrl = map->ctrl + group * MAP_GROUP;
+
+        for(unsigned match = group_match(ctrl, h2); match; match &= match - 1){
+            size_t slot = group * MAP_GROUP + first_bit(match);
+
+            if(map_keys_equal(key, map_key(slot, map), map)){
+                return slot;
+            }
+        }
+
+        if(group_match(ctrl, CTRL_EMPTY)){
+            return SIZE_MAX;
+        }
+
+        group = (group + step) & mask;
+    }
+}
+
+// First empty or deleted slot on the key's probe sequence. The load limit
+// keeps at least one empty slot in the table.
+static size_t map_find_free(uint64_t hash, const LZMap *map){
+    size_t mask = map->cap / MAP_GROUP - 1;
+    size_t group = (size_t)(hash >> 7) & mask;
+
+    for(size_t step = 1;; step++){
+        unsigned free_slots = group_free(map->ctrl + group * MAP_GROUP);
+
+        if(free_slots){
+            return group * MAP_GROUP + first_bit(free_slots);
+        }
+
+        group = (group + step) & mask;
+    }
+}
+
+// Moves the entries into a table of new_cap slots. When the current table
+// is the arena's top allocation it is extended in place, the new table is
+// built right after the old one and then slid down over it, so growing a
+// map that nothing was allocated after leaves no dead table behind.
+static int map_rehash(size_t new_cap, LZMap *map){
+    LZArena *arena = map->arena;
+    LZRegion *current = arena->current;
+    size_t alignment = map_alignment(map);
+    size_t keys_at;
+    size_t values_at;
+    size_t size;
+    size_t old_size = 0;
+    size_t gap = 0;
+    unsigned char *old = map->ctrl;
+    unsigned char *table = NULL;
+
+    if(map_layout(new_cap, &keys_at, &values_at, &size, map)){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    if(old){
+        size_t old_keys_at;
+        size_t old_values_at;
+
+        map_layout(map->cap, &old_keys_at, &old_values_at, &old_size, map);
+        gap = align_forward(old_size, alignment);
+
+        if(current && gap <= SIZE_MAX - size && region_resize_top(old, old_size, gap + size, alignment, current)){
+            table = old + gap;
+        }
+    }
+
+    int in_place = table != NULL;
+
+    if(!table){
+        table = lzarena_alloc_align(size, alignment, arena);
+
+        if(!table){
+            return LZARENA_ERR_ALLOC;
+        }
+    }
+
+    LZMap next = *map;
+
+    next.ctrl = table;
+    next.keys = table + keys_at;
+    next.values = table + values_at;
+    next.cap = new_cap;
+    next.growth_left = map_max_load(new_cap) - map->len;
+    memset(table, CTRL_EMPTY, new_cap);
+
+    for(size_t slot = 0; old && slot < map->cap; slot++){
+        if(old[slot] & 0x80){
+            continue;
+        }
+
+        const void *key = map_key(slot, map);
+        size_t to = map_find_free(map->hash(key, map->key_size), &next);
+
+        next.ctrl[to] = old[slot];
+        memcpy(map_key(to, &next), key, map->key_size);
+        memcpy(map_value(to, &next), map_value(slot, map), map->value_size);
+    }
+
+    if(in_place){
+        memmove(old, table, size);
+        region_resize_top(old, gap + size, size, alignment, current);
+        STAT(count_used(arena));
+
+        next.ctrl = old;
+        next.keys = old + keys_at;
+        next.values = old + values_at;
+    }
+
+    *map = next;
+
+    return LZARENA_OK;
+}
+
+void lzmap_init(size_t key_size, size_t value_size, size_t alignment, LZMapHash hash, LZMapEqual equal, LZArena *arena, LZMap *map){
+    assert(key_size > 0 && is_power_of_two(alignment));
+    assert(LZMAP_MIN_CAPACITY >= MAP_GROUP && is_power_of_two(LZMAP_MIN_CAPACITY));
+
+    map->ctrl = NULL;
+    map->keys = NULL;
+    map->values = NULL;
+    map->len = 0;
+    map->cap = 0;
+    map->growth_left = 0;
+    map->key_size = key_size;
+    map->value_size = value_size;
+    map->alignment = alignment;
+    map->hash = hash ? hash : lzmap_hash_bytes;
+    map->equal = equal;
+    map->arena = arena;
+}
+
+int lzmap_reserve(size_t count, LZMap *map){
+    size_t cap = map->cap ? map->cap : LZMAP_MIN_CAPACITY;
+
+    while(map_max_load(cap) < count){
+        if(cap > SIZE_MAX / 2){
+            return LZARENA_ERR_ALLOC;
+        }
+
+        cap *= 2;
+    }
+
+    if(cap == map->cap){
+        return LZARENA_OK;
+    }
+
+    return map_rehash(cap, map);
+}
+
+void *lzmap_get(const void *key, const LZMap *map){
+    size_t slot = map_find(key, map->hash(key, map->key_size), map);
+
+    return slot == SIZE_MAX ? NULL : map_value(slot, map);
+}
+
+void *lzmap_put(const void *key, LZMap *map){
+    uint64_t hash = map->hash(key, map->key_size);
+    size_t slot = map_find(key, hash, map);
+
+    if(slot != SIZE_MAX){
+        return map_value(slot, map);
+    }
+
+    if(!map->growth_left){
+        size_t cap = map->cap ? map->cap : LZMAP_MIN_CAPACITY;
+
+        // Tables that filled up with deleted slots are rebuilt at the
+        // same size.
+        if(map->cap && map->len >= map_max_load(map->cap) / 2){
+            if(cap > SIZE_MAX / 2){
+                return NULL;
+            }
+
+            cap *= 2;
+        }
+
+        if(map_rehash(cap, map)){
+            return NULL;
+        }
+    }
+
+    slot = map_find_free(hash, map);
+
+    if(map->ctrl[slot] == CTRL_EMPTY){
+        map->growth_left--;
+    }
+
+    map->ctrl[slot] = (unsigned char)(hash & 0x7F);
+    map->len++;
+    memcpy(map_key(slot, map), key, map->key_size);
+
+    void *value = map_value(slot, map);
+    memset(value, 0, map->value_size);
+
+    return value;
+}
+
+int lzmap_remove(const void *key, LZMap *map){
+    size_t slot = map_find(key, map->hash(key, map->key_size), map);
+
+    if(slot == SIZE_MAX){
+        return 0;
+    }
+
+    // Probes stop at the first group with an empty slot, so if this group
+    // already has one no probe ever runs past it and the slot can go back
+    // to empty instead of leaving a tombstone.
+    if(group_match(map->ctrl + (slot & ~(size_t)(MAP_GROUP - 1)), CTRL_EMPTY)){
+        map->ctrl[slot] = CTRL_EMPTY;
+        map->growth_left++;
+    }else{
+        map->ctrl[slot] = CTRL_DELETED;
+    }
+
+    map->len--;
+
+    return 1;
+}
+
+int lzmap_next(size_t *iter, void **key, void **value, const LZMap *map){
+    for(size_t slot = *iter; slot < map->cap; slot++){
+        if(map->ctrl[slot] & 0x80){
+            continue;
+        }
+
+        *iter = slot + 1;
+
+        if(key){
+            *key = map_key(slot, map);
+        }
+
+        if(value){
+            *value = map_value(slot, map);
+        }
+
+        return 1;
+    }
+
+    *iter = map->cap;
+
+    return 0;
+}
+
+void lzmap_clear(LZMap *map){
+    if(map->ctrl){
+        memset(map->ctrl, CTRL_EMPTY, map->cap);
+    }
+
+    map->len = 0;
+    map->growth_left = map_max_load(map->cap);
+}
+
+static inline uint64_t hash_mix(uint64_t x){
+    x ^= x >> 32;
+    x *= 0xD6E8FEB86659FD93ull;
+    x ^= x >> 32;
+    x *= 0xD6E8FEB86659FD93ull;
+    x ^= x >> 32;
+
+    return x;
+}
+
+uint64_t lzmap_hash_bytes(const void *key, size_t key_size){
+    const unsigned char *bytes = key;
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ key_size;
+    uint64_t word;
+
+    for(; key_size >= 8; bytes += 8, key_size -= 8){
+        memcpy(&word, bytes, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 29;
+    }
+
+    if(key_size){
+        word = 0;
+        memcpy(&word, bytes, key_size);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+    }
+
+    return hash_mix(hash);
+}
+
+struct lzshared_region{
+    _Atomic uintptr_t offset;
+    uintptr_t end;
+    uintptr_t start;
+    LZRegion *region;
+    LZSharedRegion *next;
+    LZSharedRegion *spare;
+};
+
+struct lzshared_arena{
+    void *buffer;
+    size_t region_size;
+    LZArenaAllocator *allocator;
+    _Atomic(LZSharedRegion *) head;
+    _Atomic(LZSharedRegion *) current;
+    _Atomic(LZSharedRegion *) spare;
+};
+
+static LZSharedRegion *create_shared_region(size_t size, LZSharedArena *arena){
+    size_t header_len = align_forward(sizeof(LZSharedRegion), LZARENA_DEFAULT_ALIGNMENT);
+    size_t buff_len = size + header_len + REGION_SIZE + LZARENA_DEFAULT_ALIGNMENT * 2;
+
+    buff_len = buff_len > arena->region_size ? buff_len : arena->region_size;
+
+    LZRegion *region = create_region(buff_len, NULL, arena->allocator);
+
+    if(!region){
+        return NULL;
+    }
+
+    size_t available = lzregion_available_alignment(LZARENA_DEFAULT_ALIGNMENT, region);
+    size_t len = buff_len < available ? buff_len : available;
+    LZSharedRegion *shared = (LZSharedRegion *)lzregion_alloc_align(len, LZARENA_DEFAULT_ALIGNMENT, region);
+
+    if(!shared){
+        destroy_region(region, NULL, arena->allocator);
+        return NULL;
+    }
+
+    shared->start = (uintptr_t)shared + header_len;
+    shared->end = (uintptr_t)shared + len;
+    shared->region = region;
+    shared->spare = NULL;
+    atomic_init(&shared->offset, shared->start);
+
+    LZSharedRegion *head = atomic_load_explicit(&arena->head, memory_order_relaxed);
+
+    do{
+        shared->next = head;
+    }while(!atomic_compare_exchange_weak_explicit(
+        &arena->head,
+        &head,
+        shared,
+        memory_order_release,
+        memory_order_relaxed
+    ));
+
+    return shared;
+}
+
+// Spare regions are only pushed by lzshared_arena_free_all, which must not
+// run concurrently with allocations, so popping them here is ABA-free.
+static LZSharedRegion *pop_spare_region(size_t size, LZSharedArena *arena){
+    LZSharedRegion *spare = atomic_load_explicit(&arena->spare, memory_order_acquire);
+
+    while(spare && size <= spare->end - spare->start){
+        if(atomic_compare_exchange_weak_explicit(
+            &arena->spare,
+            &spare,
+            spare->spare,
+            memory_order_acquire,
+            memory_order_acquire
+        )){
+            return spare;
+        }
+    }
+
+    return NULL;
+}
+
+static int next_shared_region(LZSharedRegion *expected, size_t size, LZSharedArena *arena){
+    LZSharedRegion *current = atomic_load_explicit(&arena->current, memory_order_acquire);
+
+    if(current != expected){
+        return LZARENA_OK;
+    }
+
+    LZSharedRegion *region = pop_spare_region(size, arena);
+
+    if(!region){
+        region = create_shared_region(size, arena);
+    }
+
+    if(!region){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    // If another thread installed a region first, ours stays owned by the
+    // arena through head and is reused after the next free_all.
+    atomic_compare_exchange_strong_explicit(
+        &arena->current,
+        &current,
+        region,
+        memory_order_release,
+        memory_order_acquire
+    );
+
+    return LZARENA_OK;
+}
 
-#ifdef _WIN32
-    static DWORD windows_page_size(){
-        SYSTEM_INFO sysinfo;
-        GetSystemInfo(&sysinfo);
-        return sysinfo.dwPageSize;
+LZSharedArena *lzshared_arena_create(size_t region_size, LZArenaAllocator *allocator){
+    void *buffer = NULL;
+    LZSharedArena *arena = (LZSharedArena *)alloc_object(sizeof(LZSharedArena), &buffer, allocator);
+
+    if(!arena){
+        return NULL;
     }
 
-    #define PAGE_SIZE windows_page_size()
-#elif __linux__
-    #define PAGE_SIZE sysconf(_SC_PAGESIZE)
-#endif
+    arena->buffer = buffer;
 
-#define REGION_SIZE sizeof(LZRegion)
-#define ARENA_SIZE sizeof(LZArena)
+    arena->region_size = region_size ? region_size : (size_t)PAGE_SIZE * LZARENA_DEFAULT_FACTOR;
+    arena->allocator = allocator;
+    atomic_init(&arena->head, NULL);
+    atomic_init(&arena->current, NULL);
+    atomic_init(&arena->spare, NULL);
 
-static inline int is_power_of_two(uintptr_t x){
-    return (x & (x - 1)) == 0;
+    return arena;
 }
 
-static inline uintptr_t align_forward(uintptr_t addr, size_t alignment){
-    assert(is_power_of_two(alignment));
+void lzshared_arena_destroy(LZSharedArena *arena){
+    if(!arena){
+        return;
+    }
 
-    size_t module = addr & (alignment - 1);;
-    size_t padding = module == 0 ? 0 : alignment - module;
+    LZArenaAllocator *allocator = arena->allocator;
+    LZSharedRegion *current = atomic_load(&arena->head);
 
-    return addr + padding;
-}
+    while(current){
+        LZSharedRegion *next = current->next;
+        destroy_region(current->region, NULL, allocator);
+        current = next;
+    }
 
-static inline void *lzalloc(size_t size, LZArenaAllocator *allocator){
-    return allocator ? allocator->alloc(size, allocator->ctx) : malloc(size);
+    free_object(arena->buffer, sizeof(LZSharedArena), allocator);
 }
 
-static inline void lzdealloc(void *ptr, size_t size, LZArenaAllocator *allocator){
-    if(!ptr){
-        return;
-    }
+void lzshared_arena_free_all(LZSharedArena *arena){
+    LZSharedRegion *current = atomic_load(&arena->current);
+    LZSharedRegion *spare = NULL;
 
-    if(allocator){
-        allocator->dealloc(ptr, size, allocator->ctx);
-    }else{
-        free(ptr);
+    for(LZSharedRegion *region = atomic_load(&arena->head); region; region = region->next){
+        atomic_store_explicit(&region->offset, region->start, memory_order_relaxed);
+
+        if(region != current){
+            region->spare = spare;
+            spare = region;
+        }
     }
+
+    atomic_store(&arena->spare, spare);
 }
 
-static int append_region(size_t size, LZArena *arena){
-    size += REGION_SIZE;
+void *lzshared_arena_alloc_align(size_t size, size_t alignment, LZSharedArena *arena){
+    assert(is_power_of_two(alignment));
 
-    size_t base_size = PAGE_SIZE * LZARENA_DEFAULT_FACTOR;
-    size_t buff_len = size > base_size ? (size / base_size + 1) * PAGE_SIZE * 2: base_size;
+    size_t reserve = alignment <= LZARENA_DEFAULT_ALIGNMENT ?
+        align_forward(size, LZARENA_DEFAULT_ALIGNMENT) :
+        size + alignment - 1;
 
-	LZRegion *region = NULL;
-    LZArenaAllocator *allocator = arena->allocator;
+    for(;;){
+        LZSharedRegion *current = atomic_load_explicit(&arena->current, memory_order_acquire);
 
-    if(allocator){
-        void *buff = lzalloc(buff_len, allocator);
+        if(current){
+            uintptr_t offset = atomic_fetch_add_explicit(&current->offset, reserve, memory_order_relaxed);
 
-        if(!buff){
-            return LZARENA_ERR_ALLOC;
+            if(offset <= current->end && reserve <= current->end - offset){
+                return (void *)align_forward(offset, alignment);
+            }
         }
 
-        region = lzregion_init(buff_len, buff);
-    }else{
-        region = lzregion_create(buff_len);
+        if(next_shared_region(current, reserve, arena)){
+            return NULL;
+        }
+    }
+}
+// Snapshot files hold a header, then the allocations of the arena's region
+// starting SNAPSHOT_BIAS_MASK + 1 bytes in, shifted by the chunk's address
+// modulo that, so the mapping keeps their alignment.
+#define SNAPSHOT_MAGIC "LZSNAP01"
+#define SNAPSHOT_DATA_OFFSET ((size_t)64 << 10)
+#define SNAPSHOT_BIAS_MASK (SNAPSHOT_DATA_OFFSET - 1)
+
+typedef struct snapshot_header{
+    char magic[8];
+    uint64_t pointer_size;
+    uint64_t bias;
+    uint64_t data_len;
+    uint64_t root;
+}SnapshotHeader;
+
+struct lzarena_snapshot{
+    void *base;
+    size_t len;
+    void *root;
+};
+
+int lzarena_snapshot_save(const char *path, void *root, LZArena *arena){
+    LZRegion *region = arena->head;
+
+    if(arena->large || (region && region != arena->current)){
+        return LZARENA_ERR_LAYOUT;
     }
 
-    if(!region){
-        return LZARENA_ERR_ALLOC;
+    uintptr_t chunk = region ? (uintptr_t)region->chunk : 0;
+    size_t data_len = region ? region_used(region) : 0;
+    uintptr_t addr = (uintptr_t)root;
+
+    if(root && (!region || addr < chunk || addr - chunk >= data_len)){
+        return LZARENA_ERR_LAYOUT;
     }
 
-    if(arena->tail){
-        arena->tail->next = region;
-    }else{
-        arena->head = region;
+    SnapshotHeader header = {{0}, 0, 0, 0, 0};
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.pointer_size = sizeof(void *);
+    header.bias = chunk & SNAPSHOT_BIAS_MASK;
+    header.data_len = data_len;
+    header.root = root ? addr - chunk + 1 : 0;
+
+    FILE *file = fopen(path, "wb");
+
+    if(!file){
+        return LZARENA_ERR_IO;
     }
 
-    arena->tail = region;
-    arena->current = region;
+    // The padding between blocks is written too.
+    UNPOISON(region ? region->chunk : NULL, data_len);
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fseek(file, (long)(SNAPSHOT_DATA_OFFSET + header.bias), SEEK_SET) == 0 &&
+        (data_len == 0 || fwrite(region->chunk, data_len, 1, file) == 1);
+
+    if(fclose(file) != 0 || !ok){
+        remove(path);
+        return LZARENA_ERR_IO;
+    }
 
     return LZARENA_OK;
 }
 
-LZRegion *lzregion_init(size_t buff_size, void *buffer){
-	uintptr_t buff_start = (uintptr_t)buffer;
-	uintptr_t buff_end = buff_start + buff_size;
+static int read_snapshot_header(const char *path, SnapshotHeader *header){
+    FILE *file = fopen(path, "rb");
 
-	uintptr_t region_start = align_forward(buff_start, LZARENA_DEFAULT_ALIGNMENT);
-    uintptr_t region_end = region_start + REGION_SIZE;
-    uintptr_t chunk_start = align_forward(region_end, LZARENA_DEFAULT_ALIGNMENT);
+    if(!file){
+        return LZARENA_ERR_IO;
+    }
 
-    assert(chunk_start <= buff_end);
-    assert((buff_end - chunk_start) < buff_size);
+    int ok = fread(header, sizeof(*header), 1, file) == 1;
 
-    size_t chunk_len = (buff_end - chunk_start);
-    LZRegion *region = (LZRegion *)region_start;
+    fclose(file);
 
-    region->reset = 0;
-    region->region_len = buff_size;
-	region->chunk_len = chunk_len;
-    region->offset = (void *)chunk_start;
-    region->chunk = (void *)chunk_start;
-    region->next = NULL;
+    if(!ok ||
+        memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->pointer_size != sizeof(void *) ||
+        header->bias > SNAPSHOT_BIAS_MASK ||
+        header->data_len > SIZE_MAX - SNAPSHOT_DATA_OFFSET ||
+        header->root > header->data_len){
+        return LZARENA_ERR_IO;
+    }
 
-    return region;
+    return LZARENA_OK;
 }
 
-LZRegion *lzregion_create(size_t size){
-#ifndef LZARENA_BACKEND
-    #error "a backend must be defined"
-#endif
+#ifdef __linux__
+// mmap only guarantees page alignment, so the file is mapped over a
+// SNAPSHOT_DATA_OFFSET aligned address inside a larger reservation, and
+// what is left of the reservation is unmapped again.
+static char *map_snapshot(int fd, size_t len, int mode){
+    size_t reserve_len = len + SNAPSHOT_DATA_OFFSET;
+    void *reserve = mmap(NULL, reserve_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-#if LZARENA_BACKEND == LZARENA_BACKEND_MALLOC
-    char *buffer = (char *)malloc(size);
+    if(reserve == MAP_FAILED){
+        return NULL;
+    }
 
-    if(!buffer){
+    int prot = mode == LZARENA_SNAPSHOT_COW ? PROT_READ | PROT_WRITE : PROT_READ;
+    uintptr_t start = (uintptr_t)reserve;
+    uintptr_t end = start + reserve_len;
+    uintptr_t base = align_forward(start, SNAPSHOT_DATA_OFFSET);
+    uintptr_t base_end = align_forward(base + len, PAGE_SIZE);
+
+    if(mmap((void *)base, len, prot, MAP_PRIVATE | MAP_FIXED, fd, (off_t)SNAPSHOT_DATA_OFFSET) == MAP_FAILED){
+        munmap(reserve, reserve_len);
         return NULL;
     }
-#elif LZARENA_BACKEND == LZARENA_BACKEND_MMAP
-    char *buffer = (char *)mmap(
-		NULL,
-		size,
-		PROT_READ | PROT_WRITE,
-		MAP_PRIVATE | MAP_ANONYMOUS,
-		-1,
-		0
-    );
 
-    if(buffer == MAP_FAILED){
+    if(base > start){
+        munmap(reserve, base - start);
+    }
+
+    if(end > base_end){
+        munmap((void *)base_end, end - base_end);
+    }
+
+    return (char *)base;
+}
+#endif
+
+LZArenaSnapshot *lzarena_snapshot_load(const char *path, int mode){
+    SnapshotHeader header;
+
+    if(read_snapshot_header(path, &header)){
         return NULL;
     }
-#elif LZARENA_BACKEND == LZARENA_BACKEND_VIRTUALALLOC
-    char *buffer = (char *)VirtualAlloc(
-        NULL,
-        size,
-        MEM_COMMIT,
-        PAGE_READWRITE
-    );
 
-    if(!buffer){
+    LZArenaSnapshot *snapshot = (LZArenaSnapshot *)malloc(sizeof(LZArenaSnapshot));
+
+    if(!snapshot){
         return NULL;
     }
+
+    size_t len = (size_t)(header.bias + header.data_len);
+    char *base = NULL;
+
+    snapshot->len = len ? len : 1;
+
+#ifdef __linux__
+    int fd = open(path, O_RDONLY);
+    off_t file_len = fd == -1 ? 0 : lseek(fd, 0, SEEK_END);
+
+    if(fd != -1 && (header.data_len == 0 || file_len >= (off_t)(SNAPSHOT_DATA_OFFSET + len))){
+        base = map_snapshot(fd, snapshot->len, mode);
+    }
+
+    if(fd != -1){
+        close(fd);
+    }
 #else
-    #error "unknown backend"
-#endif
+    // Without mmap the data is read into a buffer aligned like the mapping
+    // would be. The buffer is always writable.
+    (void)mode;
 
-    return lzregion_init(size, buffer);
-}
+    FILE *file = fopen(path, "rb");
+    char *buffer = file ? (char *)malloc(snapshot->len + SNAPSHOT_DATA_OFFSET) : NULL;
 
-void lzregion_destroy(LZRegion *region){
-    if (!region){
-        return;
+    if(buffer){
+        base = (char *)align_forward((uintptr_t)buffer + sizeof(char *), SNAPSHOT_DATA_OFFSET);
+        ((char **)base)[-1] = buffer;
+
+        if(fseek(file, (long)(SNAPSHOT_DATA_OFFSET + header.bias), SEEK_SET) != 0 ||
+            (header.data_len && fread(base + header.bias, (size_t)header.data_len, 1, file) != 1)){
+            free(buffer);
+            base = NULL;
+        }
     }
 
-#ifndef LZARENA_BACKEND
-    #error "a backend must be defined"
+    if(file){
+        fclose(file);
+    }
 #endif
 
-#if LZARENA_BACKEND == LZARENA_BACKEND_MALLOC
-    free(region);
-#elif LZARENA_BACKEND == LZARENA_BACKEND_MMAP
-    if(munmap(region, region->region_len) == -1){
-        perror(NULL);
+    if(!base){
+        free(snapshot);
+        return NULL;
     }
-#elif LZARENA_BACKEND == LZARENA_BACKEND_VIRTUALALLOC
-    VirtualFree(region, 0, MEM_RELEASE);
-#else
-    #error "unknown backend"
-#endif
-}
 
-inline size_t lzregion_available(LZRegion *region){
-    uintptr_t buff_start = (uintptr_t)region->offset;
-    uintptr_t buff_end = buff_start + region->chunk_len;
+    snapshot->base = base;
+    snapshot->root = header.root ? base + header.bias + header.root - 1 : NULL;
 
-    assert(buff_start < buff_end);
+    return snapshot;
+}
 
-    return buff_end - buff_start;
+void *lzarena_snapshot_root(LZArenaSnapshot *snapshot){
+    return snapshot->root;
 }
 
-inline size_t lzregion_available_alignment(size_t alignment, LZRegion *region){
-    uintptr_t chunk_start = (uintptr_t)region->chunk;
-    uintptr_t chunk_end = chunk_start + region->chunk_len;
-    uintptr_t offset = (uintptr_t)region->offset;
+void lzarena_snapshot_close(LZArenaSnapshot *snapshot){
+    if(!snapshot){
+        return;
+    }
 
-    offset = align_forward(offset, alignment);
+#ifdef __linux__
+    munmap(snapshot->base, snapshot->len);
+#else
+    free(((char **)snapshot->base)[-1]);
+#endif
 
-    return offset >= chunk_end ? 0 : chunk_end - offset;
+    free(snapshot);
 }
 
-void *lzregion_alloc_align(size_t size, size_t alignment, LZRegion *region){
-    size_t available = lzregion_available_alignment(alignment, region);
+// The first page of a shared memory object holds its header. top is the
+// offset of the next free byte and is shared by every process mapping the
+// object, root is 0 or one past the root's offset.
+#define SHM_MAGIC "LZSHM001"
+
+typedef struct shm_header{
+    char magic[8];
+    uint64_t capacity;
+    _Atomic uint64_t top;
+    _Atomic uint64_t root;
+}ShmHeader;
+
+struct lzarena_shm{
+    LZArenaAllocator allocator;
+    char *base;
+    size_t len;
+    int fd;
+    char *name;
+};
+
+LZArenaAllocator *lzarena_shm_allocator(LZArenaShm *shm){
+    return &shm->allocator;
+}
 
-    if(size > available){
-        return NULL;
-    }
+int lzarena_shm_fd(LZArenaShm *shm){
+    return shm->fd;
+}
 
-    uintptr_t offset = (uintptr_t)region->offset;
+void lzarena_shm_set_root(void *root, LZArenaShm *shm){
+    ShmHeader *header = (ShmHeader *)shm->base;
+    uint64_t offset = root ? (uint64_t)((char *)root - shm->base) + 1 : 0;
 
-    offset = align_forward(offset, alignment);
-    region->offset = (void *)(offset + size);
+    atomic_store_explicit(&header->root, offset, memory_order_release);
+}
 
-    return (void *)offset;
+void *lzarena_shm_root(LZArenaShm *shm){
+    ShmHeader *header = (ShmHeader *)shm->base;
+    uint64_t offset = atomic_load_explicit(&header->root, memory_order_acquire);
+
+    return offset && offset <= shm->len ? shm->base + offset - 1 : NULL;
 }
 
-void *lzregion_calloc_align(size_t size, size_t alignment, LZRegion *region){
-    void *ptr = lzregion_alloc_align(size, alignment, region);
+#ifdef __linux__
+static void *shm_alloc(size_t size, void *ctx){
+    LZArenaShm *shm = (LZArenaShm *)ctx;
+    ShmHeader *header = (ShmHeader *)shm->base;
+    uint64_t top = atomic_load_explicit(&header->top, memory_order_relaxed);
+    uint64_t len = align_forward(size, PAGE_SIZE);
 
-    if(ptr){
-        memset(ptr, 0, size);
+    do{
+        if(len < size || len > header->capacity - top){
+            return NULL;
+        }
+    }while(!atomic_compare_exchange_weak_explicit(
+        &header->top,
+        &top,
+        top + len,
+        memory_order_relaxed,
+        memory_order_relaxed
+    ));
+
+    return shm->base + top;
+}
+
+// Gives a block back or resizes it in place only when it is the top one.
+static int shm_resize_top(void *ptr, size_t old_size, size_t new_size, LZArenaShm *shm){
+    ShmHeader *header = (ShmHeader *)shm->base;
+    uint64_t start = (uint64_t)((char *)ptr - shm->base);
+    uint64_t top = start + align_forward(old_size, PAGE_SIZE);
+    uint64_t new_top = start + align_forward(new_size, PAGE_SIZE);
+
+    if(new_top > header->capacity){
+        return 0;
     }
 
-    return ptr;
+    return atomic_compare_exchange_strong_explicit(
+        &header->top,
+        &top,
+        new_top,
+        memory_order_relaxed,
+        memory_order_relaxed
+    );
 }
 
-void *lzregion_realloc_align(void *ptr, size_t old_size, size_t new_size, size_t alignment, LZRegion *region){
-    if(new_size <= old_size){
+static void *shm_realloc(void *ptr, size_t old_size, size_t new_size, void *ctx){
+    LZArenaShm *shm = (LZArenaShm *)ctx;
+
+    if(ptr && shm_resize_top(ptr, old_size, new_size, shm)){
         return ptr;
     }
 
-	void *new_ptr = lzregion_alloc_align(new_size, alignment, region);
+    void *new_ptr = shm_alloc(new_size, ctx);
 
-	if(ptr){
-        memcpy(new_ptr, ptr, old_size);
+    if(new_ptr && ptr){
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
     }
 
     return new_ptr;
 }
 
-LZArena *lzarena_create(LZArenaAllocator *allocator){
-    LZArena *arena = (LZArena *)lzalloc(ARENA_SIZE, allocator);
+static void shm_dealloc(void *ptr, size_t size, void *ctx){
+    shm_resize_top(ptr, size, 0, (LZArenaShm *)ctx);
+}
 
-    if (!arena){
+static LZArenaShm *map_shm(int fd, size_t len, int mode, const char *name){
+    LZArenaShm *shm = (LZArenaShm *)malloc(sizeof(LZArenaShm));
+    int prot = mode == LZARENA_SHM_READWRITE ? PROT_READ | PROT_WRITE : PROT_READ;
+
+    if(!shm){
         return NULL;
     }
 
-    arena->reset = 0;
-    arena->head = NULL;
-    arena->tail = NULL;
-    arena->current = NULL;
-    arena->allocator = allocator;
-
-    return arena;
-}
+    shm->base = (char *)mmap(NULL, len, prot, MAP_SHARED, fd, 0);
+    shm->name = name ? (char *)malloc(strlen(name) + 1) : NULL;
 
-void lzarena_destroy(LZArena *arena){
-    if(!arena){
-        return;
-    }
+    if(shm->base == MAP_FAILED || (name && !shm->name)){
+        if(shm->base != MAP_FAILED){
+            munmap(shm->base, len);
+        }
 
-    LZArenaAllocator *allocator = arena->allocator;
-    LZRegion *current = arena->head;
+        free(shm->name);
+        free(shm);
 
-    while(current){
-		LZRegion *next = current->next;
+        return NULL;
+    }
 
-        if(allocator){
-            lzdealloc(current, current->region_len, allocator);
-        }else{
-            lzregion_destroy(current);
-        }
+    if(name){
+        strcpy(shm->name, name);
+    }
 
-		current = next;
-	}
+    shm->len = len;
+    shm->fd = fd;
+    shm->allocator.ctx = shm;
+    shm->allocator.alloc = shm_alloc;
+    shm->allocator.realloc = shm_realloc;
+    shm->allocator.dealloc = shm_dealloc;
 
-    lzdealloc(arena, ARENA_SIZE, allocator);
+    return shm;
 }
 
-void lzarena_report(size_t *used, size_t *size, LZArena *arena){
-    size_t u = 0;
-    size_t s = 0;
-    LZRegion *current = arena->head;
+#ifndef MFD_CLOEXEC
+    #define MFD_CLOEXEC 1U
+#endif
 
-    while(current){
-		LZRegion *next = current->next;
-		size_t available = lzregion_available(current);
-		u += current->chunk_len - available;
-		s += current->chunk_len;
-		current = next;
-	}
+LZArenaShm *lzarena_shm_create(const char *name, size_t capacity){
+    size_t header_len = align_forward(sizeof(ShmHeader), PAGE_SIZE);
+    size_t len = align_forward(capacity, PAGE_SIZE) + header_len;
 
-	*used = u;
-	*size = s;
-}
+    if(len < capacity){
+        return NULL;
+    }
 
-inline void lzarena_free_all(LZArena *arena){
-    if(!arena->current){
-        return;
+#ifdef SYS_memfd_create
+    int fd = name ?
+        shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600) :
+        (int)syscall(SYS_memfd_create, "lzarena", MFD_CLOEXEC);
+#else
+    int fd = name ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600) : -1;
+#endif
+
+    if(fd == -1){
+        return NULL;
     }
 
-    if(arena->head == arena->tail){
-        arena->current->offset = arena->current->chunk;
-    }else{
-        arena->reset++;
-        arena->current = arena->head;
+    LZArenaShm *shm = ftruncate(fd, (off_t)len) == 0 ?
+        map_shm(fd, len, LZARENA_SHM_READWRITE, name) :
+        NULL;
+
+    if(!shm){
+        close(fd);
+
+        if(name){
+            shm_unlink(name);
+        }
+
+        return NULL;
     }
+
+    ShmHeader *header = (ShmHeader *)shm->base;
+
+    memcpy(header->magic, SHM_MAGIC, sizeof(header->magic));
+    header->capacity = len;
+    atomic_init(&header->top, header_len);
+    atomic_init(&header->root, 0);
+
+    return shm;
 }
 
-void *lzarena_alloc_align(size_t size, size_t alignment, LZArena *arena){
-    while(arena->current && arena->current->next){
-        if(arena->current->reset != arena->reset){
-            arena->current->reset = arena->reset;
-            arena->current->offset = arena->current->chunk;
-            break;
-        }else if(lzregion_available_alignment(alignment, arena->current) < size){
-            arena->current->reset = 0;
-            arena->current = arena->current->next;
-        }else{
-            break;
-        }
+LZArenaShm *lzarena_shm_map(int fd, int mode){
+    off_t len = lseek(fd, 0, SEEK_END);
+
+    if(len < (off_t)sizeof(ShmHeader)){
+        return NULL;
     }
 
-    LZRegion *current = arena->current;
-    size_t available = current ? lzregion_available_alignment(alignment, current) : 0;
+    LZArenaShm *shm = map_shm(fd, (size_t)len, mode, NULL);
 
-    if(current && available >= size){
-        return lzregion_alloc_align(size, alignment, current);
+    if(!shm){
+        return NULL;
     }
 
-    if(append_region(size, arena)){
+    ShmHeader *header = (ShmHeader *)shm->base;
+
+    if(memcmp(header->magic, SHM_MAGIC, sizeof(header->magic)) != 0 || header->capacity != (uint64_t)len){
+        munmap(shm->base, shm->len);
+        free(shm);
         return NULL;
     }
 
-    return lzregion_alloc_align(size, alignment, arena->current);
+    shm->fd = -1;
+
+    return shm;
 }
 
-void *lzarena_calloc_align(size_t size, size_t alignment, LZArena *arena){
-    void *ptr = lzarena_alloc_align(size, alignment, arena);
+LZArenaShm *lzarena_shm_open(const char *name, int mode){
+    int fd = shm_open(name, mode == LZARENA_SHM_READWRITE ? O_RDWR : O_RDONLY, 0);
 
-    if(ptr){
-        memset(ptr, 0, size);
+    if(fd == -1){
+        return NULL;
     }
 
-    return ptr;
+    LZArenaShm *shm = lzarena_shm_map(fd, mode);
+
+    if(!shm){
+        close(fd);
+        return NULL;
+    }
+
+    shm->fd = fd;
+
+    return shm;
 }
 
-void *lzarena_realloc_align(void *ptr, size_t old_size, size_t new_size, size_t alignment, LZArena *arena){
-    if(new_size <= old_size){
-        return ptr;
+void lzarena_shm_destroy(LZArenaShm *shm){
+    if(!shm){
+        return;
     }
 
-	void *new_ptr = lzarena_alloc_align(new_size, alignment, arena);
+    munmap(shm->base, shm->len);
 
-	if(ptr){
-        memcpy(new_ptr, ptr, old_size);
+    if(shm->name){
+        shm_unlink(shm->name);
+        free(shm->name);
     }
 
-    return new_ptr;
-}
\ No newline at end of file
+    if(shm->fd != -1){
+        close(shm->fd);
+    }
+
+    free(shm);
+}
+#else
+LZArenaShm *lzarena_shm_create(const char *name, size_t capacity){
+    (void)name;
+    (void)capacity;
+    return NULL;
+}
+
+LZArenaShm *lzarena_shm_open(const char *name, int mode){
+    (void)name;
+    (void)mode;
+    return NULL;
+}
+
+LZArenaShm *lzarena_shm_map(int fd, int mode){
+    (void)fd;
+    (void)mode;
+    return NULL;
+}
+
+void lzarena_shm_destroy(LZArenaShm *shm){
+    (void)shm;
+}
+#endif
@@ -2,17 +2,60 @@
 #define LZARENA_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
 
 #define LZARENA_OK 0
 #define LZARENA_ERR_ALLOC 1
+#define LZARENA_ERR_IO 2
+#define LZARENA_ERR_LAYOUT 3
 
 #define LZARENA_DEFAULT_ALIGNMENT 8
 #define LZARENA_DEFAULT_FACTOR 1
+#define LZARENA_DEFAULT_GROWTH 2
+#define LZARENA_DEFAULT_MAX_REGION ((size_t)64 << 20)
+#define LZARENA_DEFAULT_LARGE ((size_t)16 << 20)
 
 #define LZARENA_BACKEND_MALLOC 0
 #define LZARENA_BACKEND_MMAP 1
 #define LZARENA_BACKEND_VIRTUALALLOC 2
+#define LZARENA_BACKEND_RESERVE 3
+// Regions over memory the library doesn't own: lzregion_init buffers and
+// regions from an LZArenaAllocator. lzregion_destroy leaves them alone.
+#define LZARENA_BACKEND_USER 4
 
+// Map regions of at least the huge page size with huge pages (MAP_HUGETLB,
+// falling back to MADV_HUGEPAGE, or MEM_LARGE_PAGES), rounding them up to it.
+#define LZARENA_FLAG_HUGE_PAGES 1
+// Ask for transparent huge pages with MADV_HUGEPAGE (Linux only).
+#define LZARENA_FLAG_THP 2
+// Prefault regions when they are mapped so the first touch doesn't fault.
+#define LZARENA_FLAG_POPULATE 4
+
+// On the mmap backend, give the dirty pages of a region back with
+// MADV_DONTNEED when it is reset, if they span at least
+// LZARENA_ZERO_THRESHOLD bytes, so later callocs find them zeroed.
+#define LZARENA_FLAG_ZERO_ON_RESET 8
+
+#ifndef LZARENA_ZERO_THRESHOLD
+    #define LZARENA_ZERO_THRESHOLD ((size_t)1 << 20)
+#endif
+
+#define LZARENA_NUMA_NONE -1
+#define LZARENA_NUMA_LOCAL -2
+
+// Written over memory the arena takes back in LZARENA_DEBUG builds.
+#ifndef LZARENA_FILL_BYTE
+    #define LZARENA_FILL_BYTE 0xDD
+#endif
+
+#ifndef LZARENA_HUGE_PAGE_SIZE
+    #define LZARENA_HUGE_PAGE_SIZE ((size_t)2 << 20)
+#endif
+
+// Backend of regions created without an explicit one. Arenas can pick
+// another through LZArenaConfig.backend: malloc everywhere, mmap on Linux,
+// VirtualAlloc on Windows and reserve on both.
 #ifndef LZARENA_BACKEND
     #ifdef _WIN32
         #define LZARENA_BACKEND LZARENA_BACKEND_VIRTUALALLOC
@@ -23,9 +66,92 @@
     #endif
 #endif
 
+// Used by LZARENA_BACKEND_RESERVE: each region reserves LZARENA_RESERVE_SIZE
+// bytes of address space, commits it in LZARENA_RESERVE_COMMIT steps as the
+// offset grows and gives back everything above LZARENA_RESERVE_RETAIN bytes
+// on lzarena_free_all.
+#ifndef LZARENA_RESERVE_SIZE
+    #if SIZE_MAX > 0xFFFFFFFF
+        #define LZARENA_RESERVE_SIZE ((size_t)64 << 30)
+    #else
+        #define LZARENA_RESERVE_SIZE ((size_t)1 << 30)
+    #endif
+#endif
+
+#ifndef LZARENA_RESERVE_COMMIT
+    #define LZARENA_RESERVE_COMMIT ((size_t)64 << 10)
+#endif
+
+#ifndef LZARENA_RESERVE_RETAIN
+    #define LZARENA_RESERVE_RETAIN ((size_t)1 << 20)
+#endif
+
+// Bytes of destroyed regions each thread keeps for reuse by new regions.
+#ifndef LZARENA_CACHE_LIMIT
+    #define LZARENA_CACHE_LIMIT ((size_t)64 << 20)
+#endif
+
+// Size classes used by lzarena_alloc_sized/lzarena_free: powers of two from
+// LZARENA_BIN_MIN to LZARENA_BIN_MAX bytes.
+#define LZARENA_BIN_MIN 16
+#define LZARENA_BIN_MAX 4096
+#define LZARENA_BIN_COUNT 9
+
+#ifndef LZPOOL_DEFAULT_SLAB
+    #define LZPOOL_DEFAULT_SLAB 64
+#endif
+
+// First capacity of LZVec (in items) and LZString (in bytes) builders.
+#ifndef LZVEC_MIN_CAPACITY
+    #define LZVEC_MIN_CAPACITY 8
+#endif
+
+#ifndef LZSTRING_MIN_CAPACITY
+    #define LZSTRING_MIN_CAPACITY 64
+#endif
+
+// First table size of an LZMap. Must be a power of two and at least 16.
+#ifndef LZMAP_MIN_CAPACITY
+    #define LZMAP_MIN_CAPACITY 16
+#endif
+
+#ifndef LZARENA_SCRATCH_COUNT
+    #define LZARENA_SCRATCH_COUNT 2
+#endif
+
+// Events each thread keeps when no trace hook is installed.
+#ifndef LZARENA_TRACE_RING
+    #define LZARENA_TRACE_RING 1024
+#endif
+
+#define LZARENA_TRACE_ALLOC 0
+#define LZARENA_TRACE_REALLOC 1
+#define LZARENA_TRACE_REALLOC_COPY 2
+#define LZARENA_TRACE_APPEND 3
+#define LZARENA_TRACE_FREE_ALL 4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct lzarena_allocator LZArenaAllocator;
 typedef struct lzregion LZRegion;
 typedef struct lzarena LZArena;
+typedef struct lzarena_config LZArenaConfig;
+typedef struct lzarena_cleanup LZArenaCleanup;
+typedef struct lzarena_stats LZArenaStats;
+typedef struct lzarena_trace_event LZArenaTraceEvent;
+typedef struct lzarena_mark LZArenaMark;
+typedef struct lzarena_scratch LZArenaScratch;
+typedef struct lzpool LZPool;
+typedef struct lzvec LZVec;
+typedef struct lzstring LZString;
+typedef struct lzmap LZMap;
+typedef struct lzshared_region LZSharedRegion;
+typedef struct lzshared_arena LZSharedArena;
+typedef struct lzarena_offset_ptr LZArenaOffsetPtr;
+typedef struct lzarena_snapshot LZArenaSnapshot;
+typedef struct lzarena_shm LZArenaShm;
 
 struct lzarena_allocator{
     void *ctx;
@@ -35,28 +161,174 @@ struct lzarena_allocator{
 };
 
 struct lzregion{
-    char reset;
     size_t region_len;
     size_t chunk_len;
     void *offset;
     void *chunk;
+    void *commit;
+    void *dirty;
     LZRegion *next;
+    void *buffer;
+    int backend;
+};
+
+// Each appended region is growth_factor times bigger than the previous one,
+// starting at initial_size and capped at max_region_size. Requests of at
+// least large_size bytes (0 disables it) that don't fit the current region
+// get a dedicated region, released on lzarena_free_all or when rewinding
+// past them. flags takes LZARENA_FLAG_* values applied to every region and
+// numa_node is a node number, LZARENA_NUMA_LOCAL for the node of the calling
+// CPU or LZARENA_NUMA_NONE. A non-zero trim_factor makes lzarena_free_all
+// trim the arena to trim_factor times its recent average peak footprint.
+// backend is one of the LZARENA_BACKEND_* values available on the platform,
+// LZARENA_BACKEND by default; it is ignored when the arena has an allocator.
+struct lzarena_config{
+    size_t initial_size;
+    size_t growth_factor;
+    size_t max_region_size;
+    size_t large_size;
+    int flags;
+    int numa_node;
+    size_t trim_factor;
+    int backend;
+};
+
+struct lzarena_cleanup{
+    void (*fn)(void *ctx);
+    void *ctx;
+    LZArenaCleanup *next;
+};
+
+// Counters kept when the library is built with LZARENA_STATS, all zero
+// otherwise. alloc_count to realloc_copies add up over the arena's life:
+// bytes_padding is lost to alignment and bytes_skipped is left at the end of
+// regions the arena moved past. used, peak_used, region_count and size
+// describe the arena right now, including its large regions.
+struct lzarena_stats{
+    size_t alloc_count;
+    size_t bytes_requested;
+    size_t bytes_padding;
+    size_t bytes_skipped;
+    size_t region_appends;
+    size_t resets;
+    size_t realloc_inplace;
+    size_t realloc_copies;
+    size_t used;
+    size_t peak_used;
+    size_t region_count;
+    size_t size;
+};
+
+// ptr is the block, or the new region for LZARENA_TRACE_APPEND, whose size
+// is the region length. start is the cycle counter when the call began and
+// cycles how long it took.
+struct lzarena_trace_event{
+    int kind;
+    const char *site;
+    LZArena *arena;
+    void *ptr;
+    size_t size;
+    size_t old_size;
+    size_t alignment;
+    uint64_t start;
+    uint64_t cycles;
+};
+
+typedef void (*LZArenaTraceHook)(const LZArenaTraceEvent *event, void *ctx);
+typedef uint64_t (*LZMapHash)(const void *key, size_t key_size);
+typedef int (*LZMapEqual)(const void *a, const void *b, size_t key_size);
+
+// Keys, values and control bytes live in separate arrays of one arena
+// block. A control byte holds 7 bits of the key's hash, or marks the slot
+// as empty or deleted, so lookups compare 16 of them at a time before
+// touching any key.
+struct lzmap{
+    unsigned char *ctrl;
+    void *keys;
+    void *values;
+    size_t len;
+    size_t cap;
+    size_t growth_left;
+    size_t key_size;
+    size_t value_size;
+    size_t alignment;
+    LZMapHash hash;
+    LZMapEqual equal;
+    LZArena *arena;
 };
 
 struct lzarena{
-    char reset;
+    size_t region_size;
+    size_t used_len;
+    size_t peak_len;
+    size_t avg_peak;
+    LZArenaConfig config;
     LZRegion *head;
     LZRegion *tail;
     LZRegion *current;
+    LZRegion *large;
+    LZArenaCleanup *cleanups;
     LZArenaAllocator *allocator;
+    void *bins[LZARENA_BIN_COUNT];
+    void *free_blocks;
+    void *buffer;
+    size_t closed_used;
+    LZArenaStats stats;
+};
+
+struct lzpool{
+    size_t obj_size;
+    size_t alignment;
+    size_t slab_count;
+    void *free;
+    char *slab;
+    char *slab_end;
+    LZArena *arena;
+};
+
+struct lzvec{
+    void *items;
+    size_t len;
+    size_t cap;
+    size_t item_size;
+    size_t alignment;
+    LZArena *arena;
+};
+
+struct lzstring{
+    char *buf;
+    size_t len;
+    size_t cap;
+    LZArena *arena;
+};
+
+struct lzarena_mark{
+    LZRegion *region;
+    LZRegion *large;
+    LZArenaCleanup *cleanups;
+    size_t used_len;
+    size_t closed_used;
+    void *offset;
+};
+
+struct lzarena_scratch{
+    LZArena *arena;
+    LZArenaMark mark;
 };
 
 LZRegion *lzregion_init(size_t buff_size, void *buff);
 LZRegion *lzregion_create(size_t size);
+LZRegion *lzregion_create_flags(size_t size, int flags, int numa_node);
+// Returns NULL if backend isn't available on this platform.
+LZRegion *lzregion_create_backend(size_t size, int backend, int flags, int numa_node);
 void lzregion_destroy(LZRegion *region);
 
-#define LZREGION_FREE(region){       \
-    region->offset = region->chunk;  \
+// Raises dirty first so lzregion_calloc_align zeroes what was handed out.
+#define LZREGION_FREE(region){                 \
+    if((region)->offset > (region)->dirty){    \
+        (region)->dirty = (region)->offset;    \
+    }                                          \
+    (region)->offset = (region)->chunk;        \
 }
 
 size_t lzregion_available(LZRegion *region);
@@ -65,16 +337,287 @@ void *lzregion_alloc_align(size_t size, size_t alignment, LZRegion *region);
 void *lzregion_calloc_align(size_t size, size_t alignment, LZRegion *region);
 void *lzregion_realloc_align(void *ptr, size_t old_size, size_t new_size, size_t alignment, LZRegion *region);
 
+void lzarena_config_default(LZArenaConfig *config);
 LZArena *lzarena_create(LZArenaAllocator *allocator);
+LZArena *lzarena_create_config(const LZArenaConfig *config, LZArenaAllocator *allocator);
 void lzarena_destroy(LZArena *arena);
+// Creates an arena whose regions are allocated from parent, 0 keeps the
+// default initial size. The child is destroyed when the parent is reset,
+// rewound past the child's creation or destroyed, and may be destroyed on
+// its own before that. Rewinding the parent to a mark taken while the
+// child is alive takes back the regions the child added since: the child
+// drops them, runs the cleanups recorded in them and carries on in the
+// region it used before, so only its allocations in those regions and its
+// marks taken since become invalid.
+LZArena *lzarena_create_child(size_t initial_size, LZArena *parent);
 
 #define LZARENA_OFFSET(_lzarena)((_lzarena)->current->offset)
 void lzarena_report(size_t *used, size_t *size, LZArena *arena);
+// Copies the arena's counters into stats in constant time.
+void lzarena_stats(LZArenaStats *stats, LZArena *arena);
 void lzarena_free_all(LZArena *arena);
+// Releases unused regions, past the current one, until the regions kept
+// add up to at most keep bytes. Used regions are never released.
+void lzarena_trim(size_t keep, LZArena *arena);
+// A mark stays valid until the arena is reset: rewinding to it after a
+// lzarena_free_all or past an earlier rewind is undefined.
+LZArenaMark lzarena_mark(LZArena *arena);
+void lzarena_rewind(LZArenaMark mark, LZArena *arena);
+// Registers fn(ctx) to run when the arena is reset, destroyed or rewound
+// past this point. Callbacks run newest first and their records live in
+// the arena itself.
+int lzarena_defer(void (*fn)(void *ctx), void *ctx, LZArena *arena);
 void *lzarena_alloc_align(size_t size, size_t alignment, LZArena *arena);
 void *lzarena_calloc_align(size_t size, size_t alignment, LZArena *arena);
+// Allocates count blocks of the given sizes in one contiguous, aligned run:
+// capacity is checked once and at most one region is appended. Fills out
+// and returns LZARENA_OK, or returns LZARENA_ERR_ALLOC leaving out untouched.
+int lzarena_alloc_batch(size_t count, const size_t *sizes, size_t alignment, void **out, LZArena *arena);
+// General-purpose mode on top of the bump allocator: blocks up to
+// LZARENA_BIN_MAX bytes are rounded to their size class and given back to
+// per-class free lists by lzarena_free, to be reused by later requests of
+// the same class. Larger blocks are rounded to a multiple of LZARENA_BIN_MAX,
+// and go back to the bump offset when they are the top allocation and to a
+// first-fit list otherwise. Blocks are LZARENA_BIN_MIN aligned. The free
+// lists are emptied by lzarena_free_all and lzarena_rewind.
+void *lzarena_alloc_sized(size_t size, LZArena *arena);
+void lzarena_free(void *ptr, size_t size, LZArena *arena);
 void *lzarena_realloc_align(void *ptr, size_t old_size, size_t new_size, size_t alignment, LZArena *arena);
+// Regions released by arenas without a user allocator or placement options
+// go to a per-thread cache, bucketed by power-of-two size, that new regions
+// are taken from. The limit and trim functions work on the calling thread's
+// cache, which is emptied when the thread exits.
+void lzarena_cache_set_limit(size_t limit);
+void lzarena_cache_trim(size_t keep);
+size_t lzarena_cache_size(void);
+
+// Hands out one of the calling thread's LZARENA_SCRATCH_COUNT scratch
+// arenas that is not in conflicts, so temporaries never land in an arena
+// the caller is using for its results. scratch.arena is NULL if every
+// scratch arena conflicts or creating one failed.
+LZArenaScratch lzarena_scratch_begin(size_t count, LZArena **conflicts);
+void lzarena_scratch_end(LZArenaScratch scratch);
+// Destroys the calling thread's scratch arenas, which otherwise live until
+// the thread exits.
+void lzarena_scratch_release(void);
+
+#ifdef LZARENA_TRACE
+    #define LZARENA_STR_(x) #x
+    #define LZARENA_STR(x) LZARENA_STR_(x)
+    #define LZARENA_SITE (__FILE__ ":" LZARENA_STR(__LINE__))
+
+// Builds with LZARENA_TRACE report allocations, reallocations, region
+// appends and resets to the hook, or to the calling thread's ring of the
+// last LZARENA_TRACE_RING events when there is none. Install the hook
+// before any arena is used. Events carry the calling thread's site tag,
+// set with lzarena_trace_site or per call by the _at functions, which the
+// LZARENA_ALLOC macros use to tag events with the file and line.
+void lzarena_trace_hook(LZArenaTraceHook hook, void *ctx);
+const char *lzarena_trace_site(const char *site);
+// Moves up to max of the calling thread's buffered events, oldest first,
+// into events and returns how many it moved.
+size_t lzarena_trace_read(LZArenaTraceEvent *events, size_t max);
+void *lzarena_alloc_align_at(size_t size, size_t alignment, const char *site, LZArena *arena);
+void *lzarena_realloc_align_at(void *ptr, size_t old_size, size_t new_size, size_t alignment, const char *site, LZArena *arena);
+
+#define LZARENA_ALLOC(size, arena)(lzarena_alloc_align_at(size, LZARENA_DEFAULT_ALIGNMENT, LZARENA_SITE, arena))
+#define LZARENA_REALLOC(ptr, old_size, new_size, arena)(lzarena_realloc_align_at(ptr, old_size, new_size, LZARENA_DEFAULT_ALIGNMENT, LZARENA_SITE, arena))
+#else
 #define LZARENA_ALLOC(size, arena)(lzarena_alloc_align(size, LZARENA_DEFAULT_ALIGNMENT, arena))
 #define LZARENA_REALLOC(ptr, old_size, new_size, arena)(lzarena_realloc_align(ptr, old_size, new_size, LZARENA_DEFAULT_ALIGNMENT, arena))
+#endif
+
+// Bumps the current region inline and only calls into lzarena_alloc_align
+// when the request doesn't fit its committed space. Builds with
+// LZARENA_STATS, LZARENA_TRACE or LZARENA_DEBUG always take the out-of-line
+// path.
+static inline void *lzarena_alloc_fast(size_t size, size_t alignment, LZArena *arena){
+#if defined(LZARENA_STATS) || defined(LZARENA_TRACE) || defined(LZARENA_DEBUG)
+    return lzarena_alloc_align(size, alignment, arena);
+#else
+    LZRegion *current = arena->current;
+
+    if(current){
+        uintptr_t mask = (uintptr_t)alignment - 1;
+        uintptr_t offset = ((uintptr_t)current->offset + mask) & ~mask;
+        uintptr_t end = (uintptr_t)current->commit;
+
+        if(offset <= end && size <= end - offset){
+            current->offset = (void *)(offset + size);
+            return (void *)offset;
+        }
+    }
+
+    return lzarena_alloc_align(size, alignment, arena);
+#endif
+}
+
+#ifdef LZARENA_TRACE
+    #define LZARENA_ALLOC_FAST(size, arena)(lzarena_alloc_align_at(size, LZARENA_DEFAULT_ALIGNMENT, LZARENA_SITE, arena))
+#else
+    #define LZARENA_ALLOC_FAST(size, arena)(lzarena_alloc_fast(size, LZARENA_DEFAULT_ALIGNMENT, arena))
+#endif
+
+// Fixed-size object pool carving slabs of slab_count objects (0 means
+// LZPOOL_DEFAULT_SLAB) out of the arena, with freed objects kept in an
+// intrusive free list. The pool lives in the arena and goes away with it on
+// lzarena_free_all. Rewinding past one of its slabs empties the pool.
+LZPool *lzpool_create(size_t obj_size, size_t alignment, size_t slab_count, LZArena *arena);
+void *lzpool_alloc_slab(LZPool *pool);
+
+static inline void *lzpool_alloc(LZPool *pool){
+    void *ptr = pool->free;
+
+    if(ptr){
+        pool->free = *(void **)ptr;
+        return ptr;
+    }
+
+    if(pool->slab < pool->slab_end){
+        ptr = pool->slab;
+        pool->slab += pool->obj_size;
+        return ptr;
+    }
+
+    return lzpool_alloc_slab(pool);
+}
+
+static inline void lzpool_free(void *ptr, LZPool *pool){
+    if(ptr){
+        *(void **)ptr = pool->free;
+        pool->free = ptr;
+    }
+}
+
+// Growable array and string builders. Their buffer doubles through
+// lzarena_realloc_align, so it extends in place while it is the arena's top
+// allocation, and finalize gives the unused capacity back to the bump
+// offset the same way. Anything allocated from the arena while building
+// makes the next growth a copy.
+void lzvec_init(size_t item_size, size_t alignment, LZArena *arena, LZVec *vec);
+int lzvec_reserve(size_t cap, LZVec *vec);
+int lzvec_append(const void *items, size_t count, LZVec *vec);
+// Shrinks the buffer to its length and returns it.
+void *lzvec_finalize(LZVec *vec);
+
+// Returns room for one more item at the end, or NULL.
+static inline void *lzvec_push(LZVec *vec){
+    if(vec->len == vec->cap && lzvec_reserve(vec->len + 1, vec)){
+        return NULL;
+    }
+
+    return (char *)vec->items + vec->len++ * vec->item_size;
+}
+
+void lzstring_init(LZArena *arena, LZString *str);
+// Makes room for cap bytes plus the terminator.
+int lzstring_reserve(size_t cap, LZString *str);
+int lzstring_append(const char *chars, size_t len, LZString *str);
+int lzstring_appendf(LZString *str, const char *format, ...);
+int lzstring_vappendf(LZString *str, const char *format, va_list args);
+// Terminates the string, shrinks the buffer to fit and returns it.
+char *lzstring_finalize(LZString *str);
+
+static inline int lzstring_push(char c, LZString *str){
+    if(str->len + 1 >= str->cap && lzstring_reserve(str->len + 1, str)){
+        return LZARENA_ERR_ALLOC;
+    }
+
+    str->buf[str->len++] = c;
+
+    return LZARENA_OK;
+}
+
+// Hash map allocating its table from an arena. Entries are never
+// destroyed, the table goes away with the arena's cycle. hash and equal
+// may be NULL to hash and compare the key bytes. alignment applies to both
+// keys and values. When the table is still the arena's top allocation a
+// rehash moves it back to its old address, otherwise the old table stays
+// behind until the arena is reset.
+void lzmap_init(size_t key_size, size_t value_size, size_t alignment, LZMapHash hash, LZMapEqual equal, LZArena *arena, LZMap *map);
+int lzmap_reserve(size_t count, LZMap *map);
+// Returns the key's value, or NULL when it is not in the map.
+void *lzmap_get(const void *key, const LZMap *map);
+// Returns the key's value, inserting it zero filled when missing. NULL
+// means the table could not grow. Growing moves every entry, so pointers
+// into the map only last until the next put.
+void *lzmap_put(const void *key, LZMap *map);
+// Returns 1 when the key was in the map.
+int lzmap_remove(const void *key, LZMap *map);
+// Walks the entries, starting with *iter set to 0. Returns 0 at the end.
+int lzmap_next(size_t *iter, void **key, void **value, const LZMap *map);
+void lzmap_clear(LZMap *map);
+uint64_t lzmap_hash_bytes(const void *key, size_t key_size);
+
+// Bump arena safe to allocate from several threads at once. Allocation is a
+// fetch-add on the current region and installing a new region is a CAS.
+// lzshared_arena_free_all and lzshared_arena_destroy must not run
+// concurrently with allocations. The allocator, if any, must be thread safe.
+LZSharedArena *lzshared_arena_create(size_t region_size, LZArenaAllocator *allocator);
+void lzshared_arena_destroy(LZSharedArena *arena);
+void lzshared_arena_free_all(LZSharedArena *arena);
+void *lzshared_arena_alloc_align(size_t size, size_t alignment, LZSharedArena *arena);
+#define LZSHARED_ARENA_ALLOC(size, arena)(lzshared_arena_alloc_align(size, LZARENA_DEFAULT_ALIGNMENT, arena))
+
+// Self-relative pointer: stores the distance from itself to its target, so
+// structures linked with them stay valid wherever their memory is mapped.
+// An offset of 0 is NULL, so an offset pointer can't point at itself.
+struct lzarena_offset_ptr{
+    intptr_t offset;
+};
+
+static inline void lzarena_offset_set(void *target, LZArenaOffsetPtr *ptr){
+    ptr->offset = target ? (intptr_t)((uintptr_t)target - (uintptr_t)ptr) : 0;
+}
+
+static inline void *lzarena_offset_get(const LZArenaOffsetPtr *ptr){
+    return ptr->offset ? (void *)((uintptr_t)ptr + (uintptr_t)ptr->offset) : NULL;
+}
+
+#define LZARENA_SNAPSHOT_READONLY 0
+#define LZARENA_SNAPSHOT_COW 1
+
+// Writes the arena's allocations to path so lzarena_snapshot_load can map
+// them back, with root marking the entry point. The contents must only
+// point within themselves through offset pointers, and must live in a
+// single region: build them in an arena on the reserve backend, or with an
+// initial_size that holds them. Returns LZARENA_ERR_LAYOUT if the arena
+// spans more than one region or root is outside it, LZARENA_ERR_IO if
+// writing fails.
+int lzarena_snapshot_save(const char *path, void *root, LZArena *arena);
+// Maps a snapshot read-only, or copy-on-write with LZARENA_SNAPSHOT_COW.
+// Alignment of the saved blocks is kept up to 64KiB. Returns NULL if the
+// file can't be read or wasn't saved by a compatible build.
+LZArenaSnapshot *lzarena_snapshot_load(const char *path, int mode);
+void *lzarena_snapshot_root(LZArenaSnapshot *snapshot);
+void lzarena_snapshot_close(LZArenaSnapshot *snapshot);
+
+#define LZARENA_SHM_READONLY 0
+#define LZARENA_SHM_READWRITE 1
+
+// Shared memory object of a fixed capacity, mapped MAP_SHARED, whose
+// allocator hands out page-aligned blocks for the regions of arenas
+// created with it. One process builds data in such an arena and links it
+// with offset pointers; other processes map the same object and read it in
+// place from lzarena_shm_root. The whole object is one mapping, so offset
+// pointers work across regions. Blocks given back other than the most
+// recent one stay used until the object is destroyed.
+//
+// lzarena_shm_create uses shm_open(name) or, with a NULL name, an
+// anonymous memfd to pass by file descriptor; lzarena_shm_open and
+// lzarena_shm_map attach to one. Linux only, NULL elsewhere.
+LZArenaShm *lzarena_shm_create(const char *name, size_t capacity);
+LZArenaShm *lzarena_shm_open(const char *name, int mode);
+LZArenaShm *lzarena_shm_map(int fd, int mode);
+// Unmaps the object, and unlinks its name if this process created it.
+void lzarena_shm_destroy(LZArenaShm *shm);
+LZArenaAllocator *lzarena_shm_allocator(LZArenaShm *shm);
+int lzarena_shm_fd(LZArenaShm *shm);
+void lzarena_shm_set_root(void *root, LZArenaShm *shm);
+void *lzarena_shm_root(LZArenaShm *shm);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
\ No newline at end of file
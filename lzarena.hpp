@@ -0,0 +1,478 @@
+#ifndef LZARENA_HPP
+#define LZARENA_HPP
+
+#include "lzarena.h"
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+    #if __has_include(<memory_resource>)
+        #include <memory_resource>
+        #define LZARENA_HAS_PMR 1
+    #endif
+#endif
+
+namespace lz{
+    template<size_t Alignment>
+    inline void *allocate(size_t size, LZArena *arena){
+        static_assert((Alignment & (Alignment - 1)) == 0, "alignment must be a power of two");
+
+        void *ptr = lzarena_alloc_fast(size, Alignment, arena);
+
+        if(!ptr){
+            throw std::bad_alloc();
+        }
+
+        return ptr;
+    }
+
+    template<typename T>
+    inline T *allocate_array(size_t count, LZArena *arena){
+        if(count > std::numeric_limits<size_t>::max() / sizeof(T)){
+            throw std::bad_array_new_length();
+        }
+
+        return static_cast<T *>(allocate<alignof(T)>(sizeof(T) * count, arena));
+    }
+
+    // Rewinds the arena to the point where the scope was created.
+    class ArenaScope{
+    public:
+        explicit ArenaScope(LZArena *arena) : arena(arena), mark(lzarena_mark(arena)){}
+
+        ~ArenaScope(){
+            lzarena_rewind(mark, arena);
+        }
+
+        ArenaScope(const ArenaScope &) = delete;
+        ArenaScope &operator=(const ArenaScope &) = delete;
+
+    private:
+        LZArena *arena;
+        LZArenaMark mark;
+    };
+
+    // Borrows a thread-local scratch arena for the lifetime of the object.
+    class Scratch{
+    public:
+        Scratch() : scratch(lzarena_scratch_begin(0, nullptr)){}
+
+        template<size_t N>
+        explicit Scratch(LZArena *(&conflicts)[N]) : scratch(lzarena_scratch_begin(N, conflicts)){}
+
+        explicit Scratch(LZArena *conflict) : scratch(lzarena_scratch_begin(1, &conflict)){}
+
+        ~Scratch(){
+            lzarena_scratch_end(scratch);
+        }
+
+        Scratch(const Scratch &) = delete;
+        Scratch &operator=(const Scratch &) = delete;
+
+        LZArena *arena() const{
+            return scratch.arena;
+        }
+
+    private:
+        LZArenaScratch scratch;
+    };
+
+    // Owning wrapper around LZArena. Objects created with make and
+    // alloc_array that are not trivially destructible register their
+    // destructors with lzarena_defer, so they run on reset, rewind
+    // (including through ArenaScope) and destruction of the arena.
+    class Arena{
+    public:
+        typedef LZArenaMark Mark;
+
+        Arena() : Arena(nullptr, nullptr){}
+
+        explicit Arena(const LZArenaConfig *config, LZArenaAllocator *allocator = nullptr) :
+            arena(lzarena_create_config(config, allocator))
+        {
+            if(!arena){
+                throw std::bad_alloc();
+            }
+        }
+
+        ~Arena(){
+            lzarena_destroy(arena);
+        }
+
+        Arena(Arena &&other) noexcept : arena(other.arena){
+            other.arena = nullptr;
+        }
+
+        Arena &operator=(Arena &&other) noexcept{
+            std::swap(arena, other.arena);
+            return *this;
+        }
+
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+
+        LZArena *get() const{
+            return arena;
+        }
+
+        void *allocate(size_t size, size_t alignment = LZARENA_DEFAULT_ALIGNMENT){
+            void *ptr = lzarena_alloc_fast(size, alignment, arena);
+
+            if(!ptr){
+                throw std::bad_alloc();
+            }
+
+            return ptr;
+        }
+
+        template<typename T, typename... Args>
+        T *make(Args &&...args){
+            T *ptr = new (lz::allocate<alignof(T)>(sizeof(T), arena)) T(std::forward<Args>(args)...);
+
+            if(!std::is_trivially_destructible<T>::value && lzarena_defer(&destroy<T>, ptr, arena)){
+                ptr->~T();
+                throw std::bad_alloc();
+            }
+
+            return ptr;
+        }
+
+        template<typename T>
+        T *alloc_array(size_t count){
+            T *ptr = allocate_array<T>(count, arena);
+
+            if(std::is_trivially_default_constructible<T>::value && std::is_trivially_destructible<T>::value){
+                return ptr;
+            }
+
+            Array *array = std::is_trivially_destructible<T>::value ?
+                nullptr :
+                static_cast<Array *>(lz::allocate<alignof(Array)>(sizeof(Array), arena));
+            size_t i = 0;
+
+            try{
+                for(; i < count; i++){
+                    new (ptr + i) T();
+                }
+            }catch(...){
+                destroy_items<T>(ptr, i);
+                throw;
+            }
+
+            if(array){
+                array->ptr = ptr;
+                array->count = count;
+
+                if(lzarena_defer(&destroy_array<T>, array, arena)){
+                    destroy_items<T>(ptr, count);
+                    throw std::bad_alloc();
+                }
+            }
+
+            return ptr;
+        }
+
+        void reset(){
+            lzarena_free_all(arena);
+        }
+
+        Mark mark() const{
+            return lzarena_mark(arena);
+        }
+
+        void rewind(const Mark &mark){
+            lzarena_rewind(mark, arena);
+        }
+
+    private:
+        struct Array{
+            void *ptr;
+            size_t count;
+        };
+
+        template<typename T>
+        static void destroy_items(T *items, size_t count){
+            while(count > 0){
+                items[--count].~T();
+            }
+        }
+
+        template<typename T>
+        static void destroy(void *ptr){
+            static_cast<T *>(ptr)->~T();
+        }
+
+        template<typename T>
+        static void destroy_array(void *ctx){
+            Array *array = static_cast<Array *>(ctx);
+            destroy_items<T>(static_cast<T *>(array->ptr), array->count);
+        }
+
+        LZArena *arena;
+    };
+
+    // STL allocator drawing from an LZArena. deallocate only gives memory
+    // back when the block is the arena's most recent allocation.
+    template<typename T>
+    class ArenaAllocator{
+    public:
+        typedef T value_type;
+
+        ArenaAllocator(LZArena *arena) noexcept : arena(arena){}
+        ArenaAllocator(Arena &arena) noexcept : arena(arena.get()){}
+
+        template<typename U>
+        ArenaAllocator(const ArenaAllocator<U> &other) noexcept : arena(other.get()){}
+
+        T *allocate(size_t count){
+            return allocate_array<T>(count, arena);
+        }
+
+        void deallocate(T *ptr, size_t count) noexcept{
+            lzarena_realloc_align(ptr, sizeof(T) * count, 0, alignof(T), arena);
+        }
+
+        LZArena *get() const noexcept{
+            return arena;
+        }
+
+        template<typename U>
+        bool operator==(const ArenaAllocator<U> &other) const noexcept{
+            return arena == other.get();
+        }
+
+        template<typename U>
+        bool operator!=(const ArenaAllocator<U> &other) const noexcept{
+            return arena != other.get();
+        }
+
+    private:
+        LZArena *arena;
+    };
+
+    // Typed LZVec. Items are moved with memcpy when the buffer cannot grow
+    // in place, so T must be trivially copyable.
+    template<typename T>
+    class Vec{
+        static_assert(std::is_trivially_copyable<T>::value, "lz::Vec items must be trivially copyable");
+
+    public:
+        explicit Vec(LZArena *arena) noexcept{
+            lzvec_init(sizeof(T), alignof(T), arena, &vec);
+        }
+
+        explicit Vec(Arena &arena) noexcept : Vec(arena.get()){}
+
+        void reserve(size_t cap){
+            if(lzvec_reserve(cap, &vec)){
+                throw std::bad_alloc();
+            }
+        }
+
+        void push_back(const T &item){
+            void *slot = lzvec_push(&vec);
+
+            if(!slot){
+                throw std::bad_alloc();
+            }
+
+            new (slot) T(item);
+        }
+
+        void append(const T *items, size_t count){
+            if(lzvec_append(items, count, &vec)){
+                throw std::bad_alloc();
+            }
+        }
+
+        T *finalize() noexcept{
+            return static_cast<T *>(lzvec_finalize(&vec));
+        }
+
+        T *data() const noexcept{
+            return static_cast<T *>(vec.items);
+        }
+
+        size_t size() const noexcept{
+            return vec.len;
+        }
+
+        size_t capacity() const noexcept{
+            return vec.cap;
+        }
+
+        T &operator[](size_t i) const noexcept{
+            return data()[i];
+        }
+
+        T *begin() const noexcept{
+            return data();
+        }
+
+        T *end() const noexcept{
+            return data() + vec.len;
+        }
+
+    private:
+        LZVec vec;
+    };
+
+    // LZString builder.
+    class String{
+    public:
+        explicit String(LZArena *arena) noexcept{
+            lzstring_init(arena, &str);
+        }
+
+        explicit String(Arena &arena) noexcept : String(arena.get()){}
+
+        void reserve(size_t cap){
+            if(lzstring_reserve(cap, &str)){
+                throw std::bad_alloc();
+            }
+        }
+
+        void push_back(char c){
+            if(lzstring_push(c, &str)){
+                throw std::bad_alloc();
+            }
+        }
+
+        void append(const char *chars, size_t len){
+            if(lzstring_append(chars, len, &str)){
+                throw std::bad_alloc();
+            }
+        }
+
+        template<typename... Args>
+        void appendf(const char *format, Args... args){
+            if(lzstring_appendf(&str, format, args...)){
+                throw std::bad_alloc();
+            }
+        }
+
+        // The returned string is terminated and lives as long as the arena.
+        const char *finalize(){
+            const char *chars = lzstring_finalize(&str);
+
+            if(!chars){
+                throw std::bad_alloc();
+            }
+
+            return chars;
+        }
+
+        const char *data() const noexcept{
+            return str.buf;
+        }
+
+        size_t size() const noexcept{
+            return str.len;
+        }
+
+    private:
+        LZString str;
+    };
+
+    // Typed LZArenaOffsetPtr. Copies point at the same target as the
+    // original, not at the same distance from themselves.
+    template<typename T>
+    class OffsetPtr{
+    public:
+        OffsetPtr() noexcept{
+            ptr.offset = 0;
+        }
+
+        OffsetPtr(T *target) noexcept{
+            lzarena_offset_set(target, &ptr);
+        }
+
+        OffsetPtr(const OffsetPtr &other) noexcept{
+            lzarena_offset_set(other.get(), &ptr);
+        }
+
+        OffsetPtr &operator=(const OffsetPtr &other) noexcept{
+            lzarena_offset_set(other.get(), &ptr);
+            return *this;
+        }
+
+        OffsetPtr &operator=(T *target) noexcept{
+            lzarena_offset_set(target, &ptr);
+            return *this;
+        }
+
+        T *get() const noexcept{
+            return static_cast<T *>(lzarena_offset_get(&ptr));
+        }
+
+        T &operator*() const noexcept{
+            return *get();
+        }
+
+        T *operator->() const noexcept{
+            return get();
+        }
+
+        explicit operator bool() const noexcept{
+            return ptr.offset != 0;
+        }
+
+    private:
+        LZArenaOffsetPtr ptr;
+    };
+
+#ifdef LZARENA_HAS_PMR
+    // memory_resource over an LZArena for std::pmr containers. Deallocating
+    // the arena's top block gives it back, anything else waits for the arena
+    // to be reset.
+    class ArenaResource : public std::pmr::memory_resource{
+    public:
+        explicit ArenaResource(LZArena *arena) noexcept : arena(arena){}
+        explicit ArenaResource(Arena &arena) noexcept : arena(arena.get()){}
+
+        LZArena *get() const noexcept{
+            return arena;
+        }
+
+        // Grows or shrinks a block in place when it is the top allocation
+        // and copies it otherwise, like lzarena_realloc_align.
+        void *reallocate(void *ptr, size_t old_size, size_t new_size, size_t alignment = alignof(std::max_align_t)){
+            void *new_ptr = lzarena_realloc_align(ptr, old_size, new_size, alignment, arena);
+
+            if(!new_ptr && new_size){
+                throw std::bad_alloc();
+            }
+
+            return new_ptr;
+        }
+
+    protected:
+        void *do_allocate(size_t bytes, size_t alignment) override{
+            void *ptr = lzarena_alloc_align(bytes, alignment, arena);
+
+            if(!ptr){
+                throw std::bad_alloc();
+            }
+
+            return ptr;
+        }
+
+        void do_deallocate(void *ptr, size_t bytes, size_t alignment) override{
+            lzarena_realloc_align(ptr, bytes, 0, alignment, arena);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override{
+            const ArenaResource *resource = dynamic_cast<const ArenaResource *>(&other);
+            return resource && resource->arena == arena;
+        }
+
+    private:
+        LZArena *arena;
+    };
+#endif
+}
+
+#endif